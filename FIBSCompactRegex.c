@@ -0,0 +1,484 @@
+/*
+ * ---  FIBSCompactRegex.c ---------------------------------------------------
+ *
+ * A regex is parsed to a small tree, and the tree compiled to code for a
+ * Thompson NFA, which is run by keeping a list of all the threads alive at
+ * each character of the message. That takes time proportional to the length
+ * of the message times the length of the code, never more, and needs no other
+ * memory than the code itself. Jumps are relative, so a piece of code can be
+ * copied for repeats.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#include "FIBSCompactRegex.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NODES    256
+#define MAX_PROGRAM  2048
+#define MAX_REPEAT   255
+#define MAX_SETS     32767
+
+enum { OP_PROGRAM, OP_CHAR, OP_ANY, OP_SET, OP_BOL, OP_EOL, OP_SPLIT, OP_JMP, OP_MATCH };
+
+typedef struct Instruction {
+    unsigned char op;
+    unsigned char c;
+    short         x;        // jump, relative to this instruction, set, or length of the program
+    short         y;        // second jump of OP_SPLIT
+} Instruction;
+
+struct FCMCodePool {
+    Instruction   *code;
+    long           used;
+    long           size;
+    unsigned char (*sets)[32];  // bit maps of the bracket expressions
+    int            nsets;
+    int            setsSize;
+};
+
+FCMCodePool * FCM_NewCodePool()
+{
+    return calloc(1, sizeof(FCMCodePool));
+}
+
+void FCM_FreeCodePool(FCMCodePool * pool)
+{
+    if (pool == NULL)
+        return;
+    free(pool->code);
+    free(pool->sets);
+    free(pool);
+}
+
+static int reserve( FCMCodePool *pool, long n )
+{
+    if (pool->used + n <= pool->size)
+        return 1;
+    long size = pool->size ? pool->size * 2 : 1024;
+    if (size < pool->used + n)
+        size = pool->used + n;
+    Instruction *code = realloc(pool->code, size * sizeof(Instruction));
+    if (code == NULL)
+        return 0;
+    pool->code = code;
+    pool->size = size;
+    return 1;
+}
+
+// Returns the number of the set, adding it if it's new, or -1.
+static int add_set( FCMCodePool *pool, const unsigned char bits[32] )
+{
+    for (int i = 0; i < pool->nsets; i++)
+        if (memcmp(pool->sets[i], bits, 32) == 0)
+            return i;
+    if (pool->nsets == MAX_SETS)
+        return -1;
+    if (pool->nsets == pool->setsSize) {
+        int size = pool->setsSize ? pool->setsSize * 2 : 16;
+        unsigned char (*sets)[32] = realloc(pool->sets, size * 32);
+        if (sets == NULL)
+            return -1;
+        pool->sets = sets;
+        pool->setsSize = size;
+    }
+    memcpy(pool->sets[pool->nsets], bits, 32);
+    return pool->nsets++;
+}
+
+void FCM_TrimCodePool(FCMCodePool * pool)
+{
+    if (pool->used > 0 && pool->used < pool->size) {
+        Instruction *code = realloc(pool->code, pool->used * sizeof(Instruction));
+        if (code) {
+            pool->code = code;
+            pool->size = pool->used;
+        }
+    }
+    if (pool->nsets > 0 && pool->nsets < pool->setsSize) {
+        unsigned char (*sets)[32] = realloc(pool->sets, pool->nsets * 32);
+        if (sets) {
+            pool->sets = sets;
+            pool->setsSize = pool->nsets;
+        }
+    }
+}
+
+size_t FCM_CodePoolMemory(const FCMCodePool * pool)
+{
+    return sizeof(FCMCodePool) + pool->size * sizeof(Instruction) + pool->setsSize * 32;
+}
+
+//--- Parsing ------------------------------------------------------------------
+
+enum { N_EMPTY, N_CHAR, N_ANY, N_SET, N_BOL, N_EOL, N_CAT, N_ALT, N_REPEAT };
+
+typedef struct Node {
+    unsigned char type;
+    unsigned char c;
+    short         set;
+    short         min;
+    short         max;      // -1 for no limit
+    short         left;
+    short         right;
+} Node;
+
+typedef struct Parser {
+    const char  *p;
+    FCMCodePool *pool;
+    int          failed;
+    int          count;
+    Node         nodes[MAX_NODES];
+} Parser;
+
+static int new_node( Parser *ps, int type, int left, int right )
+{
+    if (ps->count == MAX_NODES) {
+        ps->failed = 1;
+        return 0;
+    }
+    Node *n = &ps->nodes[ps->count];
+    memset(n, 0, sizeof(Node));
+    n->type = (unsigned char)type;
+    n->left = (short)left;
+    n->right = (short)right;
+    return ps->count++;
+}
+
+static int fail( Parser *ps )
+{
+    ps->failed = 1;
+    return 0;
+}
+
+static int parse_alternatives( Parser *ps );
+
+static int parse_set( Parser *ps )
+{
+    unsigned char bits[32] = { 0 };
+    const char *p = ps->p + 1;
+    int negate = (*p == '^');
+    if (negate)
+        p++;
+
+    for (const char *first = p; *p != ']' || p == first; p++) {
+        if (*p == '\0' || (*p == '[' && strchr(":=.", p[1])))
+            return fail( ps );
+        unsigned char lo = (unsigned char)*p, hi = lo;
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            hi = (unsigned char)p[2];
+            p += 2;
+            if (hi < lo || *p == '[')
+                return fail( ps );
+        }
+        for (int c = lo; c <= hi; c++)
+            bits[c >> 3] |= (unsigned char)(1 << (c & 7));
+    }
+    ps->p = p + 1;
+
+    if (negate)
+        for (int i = 0; i < 32; i++)
+            bits[i] = (unsigned char)~bits[i];
+    bits[0] &= (unsigned char)~1;           // no message contains '\0'
+
+    int set = add_set( ps->pool, bits );
+    if (set < 0)
+        return fail( ps );
+    int n = new_node( ps, N_SET, 0, 0 );
+    ps->nodes[n].set = (short)set;
+    return n;
+}
+
+static int parse_atom( Parser *ps )
+{
+    char c = *ps->p;
+    int n;
+
+    switch (c) {
+    case '(':
+        ps->p++;
+        if (*ps->p == ')')
+            return fail( ps );
+        n = parse_alternatives( ps );
+        if (*ps->p != ')')
+            return fail( ps );
+        ps->p++;
+        return n;
+    case '[':
+        return parse_set( ps );
+    case '.':
+        ps->p++;
+        return new_node( ps, N_ANY, 0, 0 );
+    case '^':
+        ps->p++;
+        return new_node( ps, N_BOL, 0, 0 );
+    case '$':
+        ps->p++;
+        return new_node( ps, N_EOL, 0, 0 );
+    case '\\':                              // only escaped punctuation, no GNU extensions
+        c = ps->p[1];
+        if (c == '\0' || !ispunct((unsigned char)c) || strchr("<>`'", c))
+            return fail( ps );
+        ps->p += 2;
+        break;
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case ')':
+        return fail( ps );
+    default:
+        ps->p++;
+    }
+    n = new_node( ps, N_CHAR, 0, 0 );
+    ps->nodes[n].c = (unsigned char)c;
+    return n;
+}
+
+static int parse_repeat( Parser *ps )
+{
+    int n = parse_atom( ps );
+    for (;;) {
+        int min, max;
+        char *end;
+        switch (*ps->p) {
+        case '*': min = 0; max = -1; ps->p++; break;
+        case '+': min = 1; max = -1; ps->p++; break;
+        case '?': min = 0; max = 1;  ps->p++; break;
+        case '{':
+            if (!isdigit((unsigned char)ps->p[1]))
+                return fail( ps );
+            min = max = (int)strtol(ps->p + 1, &end, 10);
+            if (*end == ',')
+                max = isdigit((unsigned char)end[1]) ? (int)strtol(end + 1, &end, 10) : (end++, -1);
+            if (*end != '}' || min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min))
+                return fail( ps );
+            ps->p = end + 1;
+            break;
+        default:
+            return n;
+        }
+        if (ps->failed || ps->nodes[n].type == N_BOL || ps->nodes[n].type == N_EOL)
+            return fail( ps );
+        n = new_node( ps, N_REPEAT, n, 0 );
+        ps->nodes[n].min = (short)min;
+        ps->nodes[n].max = (short)max;
+    }
+}
+
+static int parse_sequence( Parser *ps )
+{
+    int n = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->failed) {
+        int atom = parse_repeat( ps );
+        n = n < 0 ? atom : new_node( ps, N_CAT, n, atom );
+    }
+    return n < 0 ? new_node( ps, N_EMPTY, 0, 0 ) : n;
+}
+
+static int parse_alternatives( Parser *ps )
+{
+    int n = parse_sequence( ps );
+    while (*ps->p == '|' && !ps->failed) {
+        ps->p++;
+        int other = parse_sequence( ps );
+        if (ps->nodes[n].type == N_EMPTY || ps->nodes[other].type == N_EMPTY)
+            return fail( ps );
+        n = new_node( ps, N_ALT, n, other );
+    }
+    return n;
+}
+
+//--- Code ---------------------------------------------------------------------
+
+#define CAP(size) ((size) > MAX_PROGRAM ? MAX_PROGRAM + 1 : (size))
+
+static long code_size( const Parser *ps, int i )
+{
+    const Node *n = &ps->nodes[i];
+    long e;
+
+    switch (n->type) {
+    case N_EMPTY:
+        return 0;
+    case N_CAT:
+        return CAP(code_size( ps, n->left ) + code_size( ps, n->right ));
+    case N_ALT:                             // SPLIT, left, JMP, right
+        return CAP(2 + code_size( ps, n->left ) + code_size( ps, n->right ));
+    case N_REPEAT:
+        e = code_size( ps, n->left );
+        if (n->max < 0)                     // min copies and SPLIT back, or SPLIT, e, JMP back
+            return CAP(n->min > 0 ? n->min * e + 1 : e + 2);
+        return CAP(n->min * e + (n->max - n->min) * (e + 1));
+    default:
+        return 1;
+    }
+}
+
+static Instruction * emit( const Parser *ps, int i, Instruction *pc )
+{
+    const Node *n = &ps->nodes[i];
+    long left, right;
+
+    switch (n->type) {
+    case N_EMPTY:
+        return pc;
+    case N_CHAR:
+        *pc = (Instruction){ OP_CHAR, n->c, 0, 0 };
+        return pc + 1;
+    case N_ANY:
+        *pc = (Instruction){ OP_ANY, 0, 0, 0 };
+        return pc + 1;
+    case N_SET:
+        *pc = (Instruction){ OP_SET, 0, n->set, 0 };
+        return pc + 1;
+    case N_BOL:
+        *pc = (Instruction){ OP_BOL, 0, 0, 0 };
+        return pc + 1;
+    case N_EOL:
+        *pc = (Instruction){ OP_EOL, 0, 0, 0 };
+        return pc + 1;
+    case N_CAT:
+        return emit( ps, n->right, emit( ps, n->left, pc ) );
+    case N_ALT:
+        left = code_size( ps, n->left );
+        right = code_size( ps, n->right );
+        *pc = (Instruction){ OP_SPLIT, 0, 1, (short)(left + 2) };
+        pc = emit( ps, n->left, pc + 1 );
+        *pc = (Instruction){ OP_JMP, 0, (short)(right + 1), 0 };
+        return emit( ps, n->right, pc + 1 );
+    }
+
+    // N_REPEAT
+    left = code_size( ps, n->left );
+    if (n->max < 0 && n->min > 0) {
+        for (int k = 1; k < n->min; k++)
+            pc = emit( ps, n->left, pc );
+        Instruction *loop = pc;
+        pc = emit( ps, n->left, pc );
+        *pc = (Instruction){ OP_SPLIT, 0, (short)(loop - pc), 1 };
+        return pc + 1;
+    }
+    for (int k = 0; k < n->min; k++)
+        pc = emit( ps, n->left, pc );
+    if (n->max < 0) {
+        *pc = (Instruction){ OP_SPLIT, 0, 1, (short)(left + 2) };
+        pc = emit( ps, n->left, pc + 1 );
+        *pc = (Instruction){ OP_JMP, 0, (short)-(left + 1), 0 };
+        return pc + 1;
+    }
+    for (int k = n->min; k < n->max; k++) {
+        *pc = (Instruction){ OP_SPLIT, 0, 1, (short)(left + 1) };
+        pc = emit( ps, n->left, pc + 1 );
+    }
+    return pc;
+}
+
+long FCM_CompileCompact(FCMCodePool * pool, const char * re)
+{
+    Parser ps;
+    ps.p = re;
+    ps.pool = pool;
+    ps.failed = 0;
+    ps.count = 0;
+
+    int root = parse_alternatives( &ps );
+    if (ps.failed || *ps.p != '\0')
+        return FCM_NO_CODE;
+    long size = code_size( &ps, root );
+    if (size > MAX_PROGRAM || !reserve( pool, size + 2 ))
+        return FCM_NO_CODE;
+
+    long program = pool->used;
+    Instruction *start = pool->code + program;
+    *start = (Instruction){ OP_PROGRAM, 0, (short)(size + 1), 0 };
+    *emit( &ps, root, start + 1 ) = (Instruction){ OP_MATCH, 0, 0, 0 };
+    pool->used += size + 2;
+    return program;
+}
+
+//--- Matching -----------------------------------------------------------------
+
+typedef struct Machine {
+    const Instruction *code;
+    const char        *message;
+    unsigned          *marks;       // the step each instruction was last added in
+    short             *stack;
+    unsigned           step;
+} Machine;
+
+// Adds the thread at pc to list, and all the threads it leads to without
+// reading a character. Returns 1 if one of them is a match.
+static int add_thread( Machine *m, short *list, int *count, int pc, const char *at )
+{
+    int top = 0;
+
+#define PUSH(next) if (m->marks[next] != m->step) { m->marks[next] = m->step; m->stack[top++] = (short)(next); }
+    PUSH(pc)
+    while (top > 0) {
+        pc = m->stack[--top];
+        const Instruction *in = &m->code[pc];
+        switch (in->op) {
+        case OP_MATCH:
+            return 1;
+        case OP_JMP:
+            PUSH(pc + in->x)
+            break;
+        case OP_SPLIT:
+            PUSH(pc + in->y)
+            PUSH(pc + in->x)
+            break;
+        case OP_BOL:
+            if (at == m->message)
+                PUSH(pc + 1)
+            break;
+        case OP_EOL:
+            if (*at == '\0')
+                PUSH(pc + 1)
+            break;
+        default:
+            list[(*count)++] = (short)pc;
+        }
+    }
+#undef PUSH
+    return 0;
+}
+
+int FCM_MatchCompact(const FCMCodePool * pool, long program, const char * message)
+{
+    const Instruction *code = pool->code + program + 1;
+    const int length = pool->code[program].x;
+    const int anchored = (code[0].op == OP_BOL);
+    short lists[2][length], stack[length];
+    unsigned marks[length];
+    short *list = lists[0], *next = lists[1];
+    int count = 0;
+
+    Machine m = { code, message, marks, stack, 1 };
+    memset(marks, 0, sizeof(marks));
+
+    for (const char *at = message; ; at++) {
+        if (add_thread( &m, list, &count, 0, at ))     // a match may start here
+            return 1;
+        if (*at == '\0' || (count == 0 && anchored))
+            return 0;
+
+        const unsigned char c = (unsigned char)*at;
+        int nextCount = 0;
+        m.step++;
+        for (int i = 0; i < count; i++) {
+            const Instruction *in = &code[list[i]];
+            int ok = in->op == OP_ANY || (in->op == OP_CHAR && in->c == c)
+                  || (in->op == OP_SET && (pool->sets[in->x][c >> 3] & (1 << (c & 7))));
+            if (ok && add_thread( &m, next, &nextCount, list[i] + 1, at + 1 ))
+                return 1;
+        }
+        short *swap = list;
+        list = next;
+        next = swap;
+        count = nextCount;
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * ---  FIBSCompactRegex.h ---------------------------------------------------
+ *
+ * A small regex matcher for the compact rules of FIBSCookieMonster. Regexes
+ * are compiled to a few bytes of code each, in a pool shared by all the rules,
+ * which also keeps every bracket expression just once. The matcher only tells
+ * whether a regex matches, like regexec() with REG_NOSUB, and follows POSIX
+ * extended regexes in the C locale.
+ *
+ * Regexes using anything else, e.g. GNU extensions like \< or character
+ * classes like [:digit:], are not compiled, so they can be left to regcomp().
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef FIBSCOMPACTREGEX_H
+#define FIBSCOMPACTREGEX_H
+
+#include <stddef.h>
+
+#define FCM_NO_CODE (-1L)
+
+typedef struct FCMCodePool FCMCodePool;
+
+FCMCodePool * FCM_NewCodePool();
+void FCM_FreeCodePool(FCMCodePool * pool);
+
+// Compiles re into the pool. Returns where its code starts, or FCM_NO_CODE
+// if re is not supported, or out of memory.
+long FCM_CompileCompact(FCMCodePool * pool, const char * re);
+
+// Returns 1 if the code starting at program matches message, else 0.
+int  FCM_MatchCompact(const FCMCodePool * pool, long program, const char * message);
+
+// Frees the room kept for more code, once everything is compiled.
+void FCM_TrimCodePool(FCMCodePool * pool);
+
+size_t FCM_CodePoolMemory(const FCMCodePool * pool);
+
+#endif
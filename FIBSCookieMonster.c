@@ -34,7 +34,10 @@
 
 /* Modified by Øystein Schønning-Johansen */
 
+#define _POSIX_C_SOURCE 200809L         // clock_gettime(), nanosleep()
+
 #include "FIBSCookieMonster.h"
+#include "FIBSCompactRegex.h"
 
 #include <ctype.h>
 #include <sys/types.h>
@@ -43,6 +46,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <regex.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+#include <malloc.h>
+#define HEAP_IN_USE() heap_in_use()
+static size_t heap_in_use() { struct mallinfo2 m = mallinfo2(); return m.uordblks + m.hblkhd; }
+#else
+#define HEAP_IN_USE() 0                 // regcomp() memory is not known
+#endif
 
 #if defined(__GNUC__)
 #define UNUSED(c) c __attribute__((__unused__))
@@ -50,98 +63,1544 @@
 #define UNUSED(c)
 #endif
 
+#if defined(__GNUC__)
+#define LOAD_ACQUIRE(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_SEQ(p)          __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE_RELEASE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define EXCHANGE(p, v)       __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define ADD_SEQ(p, v)        __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define LOCKED_READS         0
+#else
+// Without atomics, readers take a mutex instead.
+#define LOAD_ACQUIRE(p)      (*(p))
+#define LOAD_SEQ(p)          (*(p))
+#define STORE_RELEASE(p, v)  (*(p) = (v))
+#define EXCHANGE(p, v)       exchange_pointer((void **)(p), (v))
+#define ADD_SEQ(p, v)        (*(p) += (v))
+#define LOCKED_READS         1
+static void * exchange_pointer(void ** p, void * v) { void * old = *p; *p = v; return old; }
+#endif
+
 #define TEST_FIBSCOOKIEMONSTER 0        // see main(), below
+#define TEST_SNAPSHOTS         0        // see the second main(), below
 
 // Principle data structure. Used internally--clients never see the dough,
 // just the finished cookie.
 typedef struct CookieDough {
-    regex_t             regex;
+    regex_t            *regex;          // NULL for compact rules...
+    const FCMCodePool  *pool;           // ...which use the code here instead
+    long                code;
     int                 cookie;
+    const char         *re;
+    char                must[16];       // literal text every match contains...
+    char                mustStart;      // ...at the start of the message
+    short               nameAt;         // where a player name starts in a match, or -1
     struct CookieDough *next;
 } CookieDough;
 
-static CookieDough * LoginBatch   = NULL;        // for LOGIN_STATE
-static CookieDough * MOTDBatch    = NULL;        // for MOTD_STATE
-static CookieDough * AlphaBatch   = NULL;        // for RUN_STATE
-static CookieDough * NumericBatch = NULL;
-static CookieDough * StarsBatch   = NULL;
+enum {
+    BATCH_Login,        // for LOGIN_STATE
+    BATCH_MOTD,         // for MOTD_STATE
+    BATCH_Alpha,        // for RUN_STATE
+    BATCH_Numeric,
+    BATCH_Stars,
+    BATCH_Count
+};
+
+#define NO_BATCH (-1)
+
+static const char * const BatchNames[BATCH_Count] = { "login", "motd", "alpha", "numeric", "stars" };
+
+// Within RUN_STATE, see run sub-states below
+enum {
+    RUN_Lobby,
+    RUN_Playing,
+    RUN_Watching,
+    RUN_DoublePending,
+    RUN_ResignPending,
+    RUN_SubStates
+};
+
+// All the rules, and everything made from them. See cookie jars below.
+typedef struct CookieJar CookieJar;
 
 // Private functions
-static void PrepareBatches();
-static CookieDough * AddCookieDough(int message, const char * re);
+static CookieJar * PrepareBatches();
+static void PrepareBlocks(CookieJar * jar);
+static void ReleaseBlocks(CookieJar * jar);
+static void PrepareSubStates(CookieJar * jar);
+static void ReleaseSubStates(CookieJar * jar);
+static CookieDough * AddCookieDough(CookieJar * jar, int message, const char * re);
 static CookieDough * ReleaseCookieDough(CookieDough * theDough);
+static void ClearSession(FCMSession * s);
+
+static int logout_state_cookies        ( FCMSession *s, const char *message );
+static int run_state_cookies           ( FCMSession *s, const char *message );
+static int motd_state_cookies          ( FCMSession *s, const char *message );
+static int login_state_cookies         ( FCMSession *s, const char *message );
+static int uninitialized_state_cookies ( FCMSession *s, const char *message );
+
+typedef int (*state_function)( FCMSession *s, const char *m );
+
+// All the state of one FIBS connection. The batches are shared by every
+// session, so a session is nothing more than where it is in the dispatch table,
+// and the block it is collecting, if any.
+struct FCMSession {
+    state_function   state;
+    int              substate;       // within RUN_STATE
+    const CookieJar *jar;            // the rules, while a message is classified
+    unsigned         shadowTicks;    // lines since the last one checked by the shadow engine
+    int              nameAt;         // nameAt of the rule that matched the last message
+    FCMBlock        *block;          // NULL unless blocks are collected
+    size_t           blockUsed;      // bytes used in block->buffer
+    FCMBlockCallback blockCallback;
+    void            *blockContext;
+    FCMObserver      observer;       // sees every cookie, if set
+    void            *observerContext;
+};
 
-static int logout_state_cookies        ( const char *message );
-static int run_state_cookies           ( const char *message );
-static int motd_state_cookies          ( const char *message );
-static int login_state_cookies         ( const char *message );
-static int uninitialized_state_cookies ( const char *message );
+// The session used by FIBSCookie() and friends.
+static FCMSession DefaultSession = { uninitialized_state_cookies, 0, NULL, 0, -1, NULL, 0, NULL, NULL, NULL, NULL };
 
-typedef int (*state_function)( const char *m );
-static state_function state = uninitialized_state_cookies;
+static pthread_mutex_t RegcompLock = PTHREAD_MUTEX_INITIALIZER;      // for late_regex()
+static regex_t * late_regex( const CookieJar *jar, const CookieDough *d );
 
-static int loop_batch_search( CookieDough *batch, const char *msg, int default_cookie )
+// regexec(), as the reference engine always does. Compact rules get their
+// regex_t the first time they're tried here.
+static int dough_regexec( const CookieJar *jar, const CookieDough *d, const char *msg )
 {
-    int cookie = default_cookie;
-    for (CookieDough *ptr = batch; (ptr); ptr = ptr->next){
-        if (regexec(&(ptr->regex), msg, 0, NULL, 0) == 0){
-            cookie = ptr->cookie;
-                break;
+    regex_t *regex = LOAD_ACQUIRE(&d->regex);
+    if (regex == NULL && (regex = late_regex( jar, d )) == NULL)
+        return FCM_MatchCompact(d->pool, d->code, msg);     // out of memory
+    return regexec(regex, msg, 0, NULL, 0) == 0;
+}
+
+// The compact matcher for compact rules, regexec() for the others.
+static int dough_match( const CookieDough *d, const char *msg )
+{
+    if (d->code != FCM_NO_CODE)
+        return FCM_MatchCompact(d->pool, d->code, msg);
+    return regexec(d->regex, msg, 0, NULL, 0) == 0;
+}
+
+static const CookieDough * loop_batch_search( const CookieJar *jar, const CookieDough *batch, const char *msg )
+{
+    for (const CookieDough *ptr = batch; (ptr); ptr = ptr->next){
+        if (dough_regexec(jar, ptr, msg)){
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+static int dough_cookie( const CookieDough *d, int default_cookie )
+{
+    return d ? d->cookie : default_cookie;
+}
+
+//--- Candidate lists -----------------------------------------------------------
+//
+// A candidate list is a short list of rules picked from a batch, tried in the
+// order of the list instead of the order of the batch. Since the batches depend
+// on order, a candidate only wins if no rule before it in the batch matches
+// as well. Those earlier rules are its guards, and are tried when the candidate
+// matches. Rules anchored with '^' that start with a different text than the
+// candidate can never match the same message, so they are not guards, which
+// keeps the guard lists short.
+
+#define MAX_PREFIX 32
+
+typedef struct Candidate {
+    CookieDough  *dough;
+    CookieDough **guards;       // NULL terminated
+} Candidate;
+
+typedef struct CandidateList {
+    int        count;
+    Candidate *candidates;
+    size_t     bytes;           // allocated for the list
+} CandidateList;
+
+// The batches, and the candidate lists made from them. Lists not used are empty.
+struct CookieJar {
+    CookieDough  *batches[BATCH_Count];
+    CandidateList subStates[RUN_SubStates][BATCH_Count];
+    CandidateList blocks[FCM_BLOCK_Kinds][BATCH_Count];
+    FCMRulesInfo  info;
+    FCMMemory     memory;
+    size_t        lateRegex;        // regexes compiled by late_regex(), under RegcompLock
+    FCMCodePool  *pool;             // code of the compact rules, if compact
+    char         *text;             // the rules file the regexes point into, if any
+};
+
+// Copies the literal text at the start of re to text, and returns its length.
+static int literal_text( const char *re, char *text )
+{
+    int n = 0;
+    for (const char *p = re; n < MAX_PREFIX; ) {
+        const char *next;
+        char c;
+        if (p[0] == '\\' && ispunct((unsigned char)p[1]) && !strchr("<>`'", p[1])) {
+            c = p[1];
+            next = p + 2;
+        } else if (*p == '\0' || strchr(".[]()*+?{}|^$\\", *p)) {
+            break;
+        } else {
+            c = *p;
+            next = p + 1;
+        }
+        if (*next != '\0' && strchr("*+?{", *next))    // the character is optional or repeated
+            break;
+        text[n++] = c;
+        p = next;
+    }
+    return n;
+}
+
+// Copies the literal text a regex must start with to prefix, and returns its length.
+// Returns -1 if the regex is not anchored at the start of the message.
+static int literal_prefix( const char *re, char *prefix )
+{
+    if (re[0] != '^' || strchr(re, '|'))
+        return -1;
+    return literal_text( re + 1, prefix );
+}
+
+// If the regex starts with a player name and then a space, copies the literal
+// text from the space on to text and returns its length, and sets the class
+// of the name to 'a' for [a-zA-Z_<>]+ or to '^' for [^ ]+. Returns -1 if not.
+static int name_head( const char *re, char *text, char *class )
+{
+    const char *p;
+    if (re[0] != '^' || strchr(re, '|'))
+        return -1;
+    if (strncmp(re + 1, "[a-zA-Z_<>]+ ", 13) == 0) {
+        *class = 'a';
+        p = re + 13;
+    } else if (strncmp(re + 1, "[^ ]+ ", 6) == 0) {
+        *class = '^';
+        p = re + 6;
+    } else
+        return -1;
+    return literal_text( p, text );
+}
+
+static int name_char( char class, char c )
+{
+    if (class == '^')
+        return c != ' ';
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '<' || c == '>';
+}
+
+// Copies the longest literal text every match of the regex contains to must,
+// truncated to size - 1 characters. Only looks outside brackets and groups.
+static void required_literal( const char *re, char *must, size_t size )
+{
+    size_t best = 0, run = 0;
+    char text[MAX_PREFIX];
+
+    must[0] = '\0';
+    if (strchr(re, '|'))
+        return;
+
+    for (const char *p = re; ; ) {
+        const char *next;
+        int literal = 0, depth = 0;
+        char c = *p;
+
+        if (p[0] == '\\' && ispunct((unsigned char)p[1]) && !strchr("<>`'", p[1])) {
+            c = p[1];
+            next = p + 2;
+            literal = 1;
+        } else if (c == '[') {                      // skip the bracket expression
+            next = p + 1;
+            if (*next == '^') next++;
+            if (*next == ']') next++;
+            while (*next && *next != ']') next++;
+            if (*next) next++;
+        } else if (c == '(') {                      // skip the group
+            next = p;
+            do {
+                if (*next == '(') depth++;
+                else if (*next == ')') depth--;
+                else if (*next == '\\' && next[1]) next++;
+                next++;
+            } while (*next && depth > 0);
+        } else if (c == '\0' || strchr(".]()*+?{}^$\\", c)) {
+            next = c ? p + 1 : p;
+        } else {
+            next = p + 1;
+            literal = 1;
+        }
+
+        int optional = (*next == '*' || *next == '?' || *next == '{');
+        if (literal && !optional && run < MAX_PREFIX)
+            text[run++] = c;
+        if (!literal || optional || *next == '+' || run == MAX_PREFIX) {
+            if (run > best) {
+                best = run < size - 1 ? run : size - 1;
+                memcpy(must, text, best);
+                must[best] = '\0';
+            }
+            run = 0;
+        }
+        if (*next == '{')
+            while (*next && *next != '}') next++;
+        if (*next && strchr("*+?}", *next))
+            next++;
+        if (c == '\0')
+            break;
+        p = next;
+    }
+}
+
+// Returns where the player name starts in a match of the regex, which has the
+// literal prefix of length n, or -1 if the name doesn't follow the prefix.
+static int name_offset( const char *re, int n )
+{
+    if (n < 0 || n == MAX_PREFIX)
+        return -1;
+    const char *p = re + 1;
+    for (int i = 0; i < n; i++)
+        p += (p[0] == '\\') ? 2 : 1;
+    if (strncmp(p, "[a-zA-Z_<>]", 11) == 0 || strncmp(p, "[^ ]", 4) == 0 || (*p == '\0' && n > 0 && p[-1] == ' '))
+        return n;
+    return -1;
+}
+
+// dough_match(), but first checks for the literal text the rule requires, which is a lot cheaper.
+static int dough_matches( const CookieDough *d, const char *msg )
+{
+    if (d->mustStart ? strncmp(msg, d->must, strlen(d->must)) != 0 : strstr(msg, d->must) == NULL)
+        return 0;
+    return dough_match( d, msg );
+}
+
+static int texts_differ( const char *a, int na, const char *b, int nb )
+{
+    for (int i = 0; i < na && i < nb; i++)
+        if (a[i] != b[i])
+            return 1;
+    return 0;
+}
+
+// True if no message that starts with prefix can match a rule that starts
+// with a player name and then text. The name ends at the first space, so
+// the prefix must be name characters up to its first space, and then agree
+// with text.
+static int name_differs( char class, const char *text, int n, const char *prefix, int np )
+{
+    int k = 0;
+    for ( ; k < np && prefix[k] != ' '; k++)
+        if (!name_char( class, prefix[k] ))
+            return 1;
+    if (k == np)                        // the prefix may end within the name
+        return 0;
+    return k == 0 || texts_differ( text, n, prefix + k, np - k );
+}
+
+// True if no message can match both regexes. Besides different literal text
+// at the start, rules that start with a player name are told apart by the
+// text after the name.
+static int disjoint_rules( const CookieDough *a, const CookieDough *b )
+{
+    char pa[MAX_PREFIX], pb[MAX_PREFIX], ta[MAX_PREFIX], tb[MAX_PREFIX], ca, cb;
+    int na = literal_prefix( a->re, pa );
+    int nb = literal_prefix( b->re, pb );
+    if (texts_differ( pa, na, pb, nb ))
+        return 1;
+
+    int ha = name_head( a->re, ta, &ca );
+    int hb = name_head( b->re, tb, &cb );
+    if (ha > 0 && hb > 0)
+        return texts_differ( ta, ha, tb, hb );
+    if (ha > 0 && nb > 0)
+        return name_differs( ca, ta, ha, pb, nb );
+    if (hb > 0 && na > 0)
+        return name_differs( cb, tb, hb, pa, na );
+    return 0;
+}
+
+// Fills list with the rules of batch whose cookie is in cookies[] (0 terminated),
+// in the order of cookies[]. Returns 0 if out of memory.
+static int MakeCandidates( CandidateList *list, CookieDough *batch, const int *cookies )
+{
+    int n = 0, count = 0;
+    for (CookieDough *ptr = batch; (ptr); ptr = ptr->next)
+        n++;
+
+    CookieDough **rules = malloc((n + 1) * sizeof(CookieDough *));
+    CookieDough **found = malloc((n + 1) * sizeof(CookieDough *));
+    int *tried = malloc((n + 1) * sizeof(int));    // position in the candidate list, or -1
+    list->count = 0;
+    list->candidates = malloc((n + 1) * sizeof(Candidate));
+    if (rules == NULL || found == NULL || tried == NULL || list->candidates == NULL) {
+        free(rules);
+        free(found);
+        free(tried);
+        free(list->candidates);
+        list->candidates = NULL;
+        return 0;
+    }
+
+    n = 0;
+    for (CookieDough *ptr = batch; (ptr); ptr = ptr->next) {
+        tried[n] = -1;
+        rules[n++] = ptr;
+    }
+    for (const int *c = cookies; *c; c++)
+        for (int i = 0; i < n; i++)
+            if (rules[i]->cookie == *c && tried[i] < 0) {
+                tried[i] = count;
+                list->candidates[count].dough = rules[i];
+                list->candidates[count++].guards = NULL;
+            }
+    list->count = count;
+
+    Candidate *fit = realloc(list->candidates, (count + 1) * sizeof(Candidate));
+    if (fit)
+        list->candidates = fit;
+    list->bytes = (count + 1) * sizeof(Candidate);
+
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        if (tried[i] < 0)
+            continue;
+        // Rules tried after this one may match too, as well as those not in the list at all.
+        int nfound = 0;
+        for (int j = 0; j < i; j++)
+            if ((tried[j] < 0 || tried[j] > tried[i]) && !disjoint_rules( rules[j], rules[i] ))
+                found[nfound++] = rules[j];
+        found[nfound++] = NULL;
+
+        CookieDough **guards = malloc(nfound * sizeof(CookieDough *));
+        if ((list->candidates[tried[i]].guards = guards) == NULL) {
+            ok = 0;
+            break;
         }
+        memcpy(guards, found, nfound * sizeof(CookieDough *));
+        list->bytes += nfound * sizeof(CookieDough *);
     }
+
+    free(rules);
+    free(found);
+    free(tried);
+    return ok;
+}
+
+static void ReleaseCandidates( CandidateList *list )
+{
+    if (list->candidates)
+        for (int i = 0; i < list->count; i++)
+            free(list->candidates[i].guards);
+    free(list->candidates);
+    list->candidates = NULL;
+    list->count = 0;
+    list->bytes = 0;
+}
+
+// Returns the rule of the first matching candidate, or a guard of it, or NULL.
+static const CookieDough * candidate_search( const CandidateList *list, const char *msg )
+{
+    for (int i = 0; i < list->count; i++) {
+        const Candidate *c = &list->candidates[i];
+        if (dough_matches( c->dough, msg )) {
+            for (CookieDough **g = c->guards; *g; g++)
+                if (dough_matches( *g, msg ))
+                    return *g;
+            return c->dough;
+        }
+    }
+    return NULL;
+}
+
+//--- Engines ------------------------------------------------------------------
+//
+// An engine finds the first rule of a batch that matches a message. They all
+// must give the same cookies as the reference engine, which just tries every
+// regex in order; the others only take shortcuts. In shadow mode every so
+// many lines of a session are also run through a second engine, and any
+// disagreement is counted and recorded.
+
+// Returns the first rule of the batch matching the message, or NULL.
+typedef const CookieDough * (*search_function)( const CookieJar *jar, int batch, int substate, const char *message );
+
+typedef struct CookieEngine {
+    const char   *name;
+    search_function search;
+} CookieEngine;
+
+static const CookieDough * regexec_search( const CookieJar *jar, int batch, int UNUSED(substate), const char *message )
+{
+    return loop_batch_search( jar, jar->batches[batch], message );
+}
+
+static const CookieDough * prefilter_search( const CookieJar *jar, int batch, int UNUSED(substate), const char *message )
+{
+    for (CookieDough *ptr = jar->batches[batch]; (ptr); ptr = ptr->next)
+        if (dough_matches( ptr, message ))
+            return ptr;
+    return NULL;
+}
+
+static const CookieDough * candidates_search( const CookieJar *jar, int batch, int substate, const char *message )
+{
+    const CookieDough *d = candidate_search( &jar->subStates[substate][batch], message );
+    if (d == NULL)
+        d = prefilter_search( jar, batch, substate, message );
+    return d;
+}
+
+static const CookieEngine Engines[] = {
+    { "regexec",    regexec_search },       // the reference
+    { "prefilter",  prefilter_search },
+    { "candidates", candidates_search },
+    { NULL,         NULL }
+};
+
+static const CookieEngine * Engine       = &Engines[0];
+static const CookieEngine * Shadow       = NULL;
+static unsigned             ShadowEvery  = 0;
+static unsigned long        ShadowCounts[2];                    // lines sampled, disagreements
+static FCMDisagreement      ShadowRecords[FCM_SHADOW_RECORDS];  // ring buffer
+static pthread_mutex_t      ShadowLock   = PTHREAD_MUTEX_INITIALIZER;
+
+static const CookieEngine * find_engine( const char *name )
+{
+    for (const CookieEngine *e = Engines; e->name; e++)
+        if (strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+static void record_disagreement( int cookie, int shadowCookie, const char *message )
+{
+    pthread_mutex_lock(&ShadowLock);
+    FCMDisagreement *r = &ShadowRecords[ShadowCounts[1]++ % FCM_SHADOW_RECORDS];
+    r->cookie = cookie;
+    r->shadowCookie = shadowCookie;
+    strncpy(r->text, message, sizeof(r->text) - 1);
+    r->text[sizeof(r->text) - 1] = '\0';
+    pthread_mutex_unlock(&ShadowLock);
+}
+
+// Searches the batch with the shadow engine too, if it's this line's turn.
+static void shadow_check( FCMSession *s, int batch, const char *message, int cookie, int default_cookie )
+{
+    const CookieEngine *shadow = LOAD_ACQUIRE(&Shadow);
+    if (shadow && ++s->shadowTicks >= LOAD_ACQUIRE(&ShadowEvery)) {
+        s->shadowTicks = 0;
+        ADD_SEQ(&ShadowCounts[0], 1);
+        int other = dough_cookie( shadow->search( s->jar, batch, s->substate, message ), default_cookie );
+        if (other != cookie)
+            record_disagreement( cookie, other, message );
+    }
+}
+
+// Searches a batch with the selected engine, and with the shadow engine if it's this line's turn.
+static int engine_search( FCMSession *s, int batch, const char *message, int default_cookie )
+{
+    const CookieEngine *engine = LOAD_ACQUIRE(&Engine);
+    const CookieDough *d = engine->search( s->jar, batch, s->substate, message );
+    int cookie = dough_cookie( d, default_cookie );
+
+    shadow_check( s, batch, message, cookie, default_cookie );
+    s->nameAt = d ? d->nameAt : -1;
     return cookie;
 }
 
-static int logout_state_cookies( const char UNUSED(*message ))
+// Selects the engine used from now on by all sessions. Returns 0 if there is no such engine.
+int FCM_SelectEngine(const char * name)
 {
-    return FIBS_PostGoodbye;
+    const CookieEngine *engine = find_engine( name );
+    if (engine)
+        STORE_RELEASE(&Engine, engine);
+    return engine != NULL;
 }
 
-static int run_state_cookies( const char *message )
+const char * FCM_EngineName()
 {
-    if (strlen(message) == 0)
-        return FIBS_Empty;
+    return LOAD_ACQUIRE(&Engine)->name;
+}
+
+// The name of engine number index, or NULL if there are not that many.
+// Engine 0 is the reference.
+const char * FCM_EngineNameAt(int index)
+{
+    int count = (int)(sizeof(Engines) / sizeof(Engines[0])) - 1;
+    return index >= 0 && index < count ? Engines[index].name : NULL;
+}
+
+// Also runs one in every lines of each session through the engine called
+// name, or stops doing so if name is NULL. Clears the counts and records.
+// Returns 0 if there is no such engine.
+int FCM_SetShadowEngine(const char * name, unsigned every)
+{
+    const CookieEngine *shadow = name ? find_engine( name ) : NULL;
+    if (name && shadow == NULL)
+        return 0;
+    pthread_mutex_lock(&ShadowLock);
+    STORE_RELEASE(&Shadow, (const CookieEngine *)NULL);
+    STORE_RELEASE(&ShadowCounts[0], 0UL);
+    ShadowCounts[1] = 0;
+    STORE_RELEASE(&ShadowEvery, every > 0 ? every : 1);
+    STORE_RELEASE(&Shadow, shadow);
+    pthread_mutex_unlock(&ShadowLock);
+    return 1;
+}
 
-    int cookie = FIBS_Unknown;
+// Copies the most recent disagreements to records, newest first, and returns
+// how many were copied. sampled and disagreements may be NULL.
+int FCM_ShadowReport(unsigned long * sampled, unsigned long * disagreements, FCMDisagreement * records, int max)
+{
+    pthread_mutex_lock(&ShadowLock);
+    unsigned long total = ShadowCounts[1];
+    if (sampled)
+        *sampled = LOAD_SEQ(&ShadowCounts[0]);
+    if (disagreements)
+        *disagreements = total;
+    int n = 0;
+    for (; n < max && n < FCM_SHADOW_RECORDS && (unsigned long)n < total; n++)
+        records[n] = ShadowRecords[(total - 1 - n) % FCM_SHADOW_RECORDS];
+    pthread_mutex_unlock(&ShadowLock);
+    return n;
+}
+
+static int logout_state_cookies( FCMSession UNUSED(*s), const char UNUSED(*message ))
+{
+    return FIBS_PostGoodbye;
+}
+
+// Picks the batch to search for a message in RUN_STATE, or NO_BATCH if the message is empty.
+static int run_state_batch( const char *message )
+{
     register const char ch = message[0];
-    if (isdigit(ch)) {         // CLIP messages and miscellaneous numeric messages
-        cookie = loop_batch_search( NumericBatch, message, cookie );
-    } else if (ch == '*') {    // '** ' messages
-        cookie = loop_batch_search( StarsBatch, message, cookie );
-    } else {                   // all other messages
-        cookie = loop_batch_search( AlphaBatch, message, cookie );
+    if (ch == '\0')
+        return NO_BATCH;
+    if (isdigit(ch))           // CLIP messages and miscellaneous numeric messages
+        return BATCH_Numeric;
+    if (ch == '*')             // '** ' messages
+        return BATCH_Stars;
+    return BATCH_Alpha;        // all other messages
+}
+
+//--- Run sub-states -----------------------------------------------------------
+//
+// Within RUN_STATE we keep track of what the user is doing: sitting in the
+// lobby, playing, watching, or waiting for an answer to a double or a resign.
+// Each sub-state has candidate lists with the messages likely to arrive in it,
+// most likely first. The full batch is only searched when none of them match,
+// so a wrong guess about the sub-state costs time, but never a wrong cookie.
+
+#define PLAYING_ALPHA \
+    FIBS_Board, FIBS_YouRoll, FIBS_PlayerRolls, FIBS_PlayerMoves, FIBS_RollOrDouble, \
+    FIBS_PleaseMove, FIBS_YourTurnToMove, FIBS_Doubles, FIBS_AcceptRejectDouble, FIBS_YouDouble, \
+    FIBS_CantMove, FIBS_OnlyPossibleMove, FIBS_BearingOff, FIBS_FirstRoll, FIBS_MakesFirstMove, \
+    FIBS_StartingNewGame, FIBS_PlayerWinsGame, FIBS_YouWinGame, FIBS_ScoreUpdate, FIBS_MatchStart, \
+    FIBS_Turn, FIBS_JoinNextGame, FIBS_DoublingCubeNow, FIBS_PlayerWantsToResign, FIBS_YouResign, \
+    FIBS_YouWinMatch, FIBS_PlayerWinsMatch, FIBS_PlayerStartsWatching, FIBS_PlayerStopsWatching
+
+#define PLAYING_STARS \
+    FIBS_BadMove, FIBS_MustMove, FIBS_NotYourTurnToRoll, FIBS_NotYourTurnToMove, \
+    FIBS_CantMoveFirstMove, FIBS_MustComeIn, FIBS_OpponentLeftGame, FIBS_Junk
+
+#define CHAT_NUMERIC \
+    CLIP_WHO_INFO, CLIP_LOGIN, CLIP_LOGOUT, CLIP_WHO_END, CLIP_SHOUTS, CLIP_SAYS, \
+    CLIP_KIBITZES, CLIP_WHISPERS, CLIP_YOU_SHOUT, CLIP_YOU_SAY, CLIP_YOU_KIBITZ, CLIP_YOU_WHISPER
+
+static const struct SubStateSpec {
+    int alpha[48];          // candidates by batch, most likely first
+    int numeric[16];
+    int stars[16];
+} SubStateSpecs[RUN_SubStates] = {
+    [RUN_Lobby] = {
+        { FIBS_PlayersStartingMatch, FIBS_PlayersStartingUnlimitedMatch, FIBS_MatchResult,
+          FIBS_ResumingLimitedMatch, FIBS_ResumingUnlimitedMatch, FIBS_NewMatchRequest,
+          FIBS_UnlimitedInvite, FIBS_ResumeMatchRequest, FIBS_TypeJoin, FIBS_WARNINGSavedMatch,
+          FIBS_Waves, FIBS_WavesAgain, FIBS_IsAway, FIBS_PlayerIsWaitingForYou,
+          FIBS_YouAreWatching, FIBS_ResumeMatchAck5, FIBS_ResumeMatchAck0, FIBS_StartingNewGame },
+        { CHAT_NUMERIC },
+        { FIBS_NewMatchAck10, FIBS_NewMatchAck9, FIBS_NewMatchAck2, FIBS_YouInvited, FIBS_Junk,
+          FIBS_UsersHeardYou, FIBS_PlayerRefusingGames }
+    },
+    [RUN_Playing] = {
+        { PLAYING_ALPHA },
+        { CHAT_NUMERIC },
+        { PLAYING_STARS }
+    },
+    [RUN_Watching] = {
+        { FIBS_Board, FIBS_PlayerRolls, FIBS_PlayerMoves, FIBS_Doubles, FIBS_PlayerAcceptsDouble,
+          FIBS_CantMove, FIBS_BearingOff, FIBS_OnlyPossibleMove, FIBS_FirstRoll, FIBS_MakesFirstMove,
+          FIBS_WatchResign, FIBS_ResignRefused, FIBS_ResignWins, FIBS_AcceptWins, FIBS_PlayerWinsGame,
+          FIBS_WatchGameWins, FIBS_StartingNewGame, FIBS_ScoreUpdate, FIBS_MatchStart,
+          FIBS_PlayerWinsMatch, FIBS_PlayerStartsWatching, FIBS_PlayerStopsWatching,
+          FIBS_YouStopWatching },
+        { CHAT_NUMERIC },
+        { FIBS_YouStopWatching, FIBS_Junk }
+    },
+    [RUN_DoublePending] = {
+        { FIBS_YouAcceptDouble, FIBS_PlayerAcceptsDouble, FIBS_YouGiveUp, FIBS_AcceptWins,
+          FIBS_YouAcceptAndWin, PLAYING_ALPHA },
+        { CHAT_NUMERIC },
+        { PLAYING_STARS }
+    },
+    [RUN_ResignPending] = {
+        { FIBS_ResignRefused, FIBS_YouReject, FIBS_ResignYouWin, FIBS_ResignWins, FIBS_YouAcceptAndWin,
+          FIBS_AcceptWins, PLAYING_ALPHA },
+        { CHAT_NUMERIC },
+        { PLAYING_STARS }
     }
+};
 
-    if (cookie == FIBS_Goodbye || cookie == FIBS_Timeout){
-        ReleaseFIBSCookieMonster();
-        state = logout_state_cookies;  /* Absorb the logout state */
+static void PrepareSubStates( CookieJar *jar )
+{
+    for (int sub = 0; sub < RUN_SubStates; sub++) {
+        CandidateList *lists = jar->subStates[sub];
+        if (!MakeCandidates( &lists[BATCH_Alpha], jar->batches[BATCH_Alpha], SubStateSpecs[sub].alpha ))
+            ReleaseCandidates( &lists[BATCH_Alpha] );
+        if (!MakeCandidates( &lists[BATCH_Numeric], jar->batches[BATCH_Numeric], SubStateSpecs[sub].numeric ))
+            ReleaseCandidates( &lists[BATCH_Numeric] );
+        if (!MakeCandidates( &lists[BATCH_Stars], jar->batches[BATCH_Stars], SubStateSpecs[sub].stars ))
+            ReleaseCandidates( &lists[BATCH_Stars] );
     }
+}
+
+static void ReleaseSubStates( CookieJar *jar )
+{
+    for (int sub = 0; sub < RUN_SubStates; sub++)
+        for (int b = 0; b < BATCH_Count; b++)
+            ReleaseCandidates( &jar->subStates[sub][b] );
+}
+
+static int next_substate( int sub, int cookie )
+{
+    switch (cookie) {
+    case FIBS_NewMatchAck9:
+    case FIBS_NewMatchAck10:
+    case FIBS_NewMatchAck2:
+    case FIBS_ResumeMatchAck0:
+    case FIBS_ResumeMatchAck5:
+        return RUN_Playing;
+    case FIBS_StartingNewGame:
+        return sub == RUN_Watching ? sub : RUN_Playing;
+
+    case FIBS_YouAreWatching:
+        return RUN_Watching;
+    case FIBS_YouStopWatching:
+        return sub == RUN_Watching ? RUN_Lobby : sub;
 
+    case FIBS_Doubles:
+    case FIBS_AcceptRejectDouble:
+    case FIBS_YouDouble:
+        return sub == RUN_Playing ? RUN_DoublePending : sub;
+    case FIBS_PlayerWantsToResign:
+    case FIBS_YouResign:
+        return sub == RUN_Playing ? RUN_ResignPending : sub;
+
+    // The double or resign is answered, or the game is over
+    case FIBS_YouAcceptDouble:
+    case FIBS_PlayerAcceptsDouble:
+    case FIBS_ResignRefused:
+    case FIBS_YouReject:
+    case FIBS_ResignWins:
+    case FIBS_ResignYouWin:
+    case FIBS_YouAcceptAndWin:
+    case FIBS_AcceptWins:
+    case FIBS_YouGiveUp:
+    case FIBS_PlayerWinsGame:
+    case FIBS_YouWinGame:
+        return (sub == RUN_DoublePending || sub == RUN_ResignPending) ? RUN_Playing : sub;
+
+    // The match is over
+    case FIBS_YouWinMatch:
+    case FIBS_PlayerWinsMatch:
+    case FIBS_YouTerminated:
+    case FIBS_OpponentLeftGame:
+    case FIBS_OpponentLogsOut:
+        return sub == RUN_Watching ? sub : RUN_Lobby;
+
+    default:
+        return sub;
+    }
+}
+
+// After FIBS_Goodbye or FIBS_Timeout the session reports FIBS_PostGoodbye
+// until it is reset. Unlike the single-session cookie monster, the batches
+// are not freed then: other sessions still use them.
+static int run_state_transition( FCMSession *s, int cookie )
+{
+    s->substate = next_substate( s->substate, cookie );
+    if (cookie == FIBS_Goodbye || cookie == FIBS_Timeout)
+        s->state = logout_state_cookies;  /* Absorb the logout state */
     return cookie;
 }
 
-static int motd_state_cookies( const char *message )
+//--- Blocks -------------------------------------------------------------------
+//
+// Some FIBS responses come as a block of lines: a header followed by lines
+// that only appear in that block. A session that collects blocks tries the
+// lines following a header against the candidates of that block only, and
+// the block ends at the first line that isn't one of them. Blocks that always
+// have an end line, like the reply to whois, are kept open until it arrives:
+// unknown lines in between join the block, other lines pass it by.
+
+static const struct BlockSpec {
+    int start[3];           // cookies starting the block
+    int alpha[40];          // cookies that may follow, by batch
+    int stars[2];
+    int end[3];             // cookies ending the block
+    int untilEnd;           // only an end cookie, or another block, ends the block
+} BlockSpecs[FCM_BLOCK_Kinds] = {
+    [FCM_BLOCK_Settings] = {
+        { FIBS_Settings },
+        { FIBS_Boardstyle, FIBS_Linelength, FIBS_Pagelength, FIBS_Redoubles, FIBS_Sortwho, FIBS_Timezone },
+        { 0 },
+        { FIBS_Timezone }
+    },
+    [FCM_BLOCK_Toggles] = {
+        { FIBS_SettingsHeader },
+        { FIBS_AllowpipTrue, FIBS_AllowpipFalse, FIBS_AutoboardTrue, FIBS_AutoboardFalse,
+          FIBS_AutodoubleTrue, FIBS_AutodoubleFalse, FIBS_AutomoveTrue, FIBS_AutomoveFalse,
+          FIBS_BellTrue, FIBS_BellFalse, FIBS_CrawfordTrue, FIBS_CrawfordFalse,
+          FIBS_DoubleTrue, FIBS_DoubleFalse, FIBS_GreedyTrue, FIBS_GreedyFalse,
+          FIBS_MoreboardsTrue, FIBS_MoreboardsFalse, FIBS_MovesTrue, FIBS_MovesFalse,
+          FIBS_NotifyTrue, FIBS_NotifyFalse, FIBS_RatingsTrue, FIBS_RatingsFalse,
+          FIBS_ReadyTrue, FIBS_ReadyFalse, FIBS_ReportTrue, FIBS_ReportFalse,
+          FIBS_SilentTrue, FIBS_SilentFalse, FIBS_TelnetTrue, FIBS_TelnetFalse,
+          FIBS_WrapTrue, FIBS_WrapFalse },
+        { 0 },
+        { FIBS_WrapTrue, FIBS_WrapFalse }
+    },
+    [FCM_BLOCK_PlayerInfo] = {
+        { FIBS_PlayerInfoStart },
+        { FIBS_LastLogin, FIBS_LastLogout, FIBS_StillLoggedIn, FIBS_NotLoggedIn, FIBS_IsPlayingWith,
+          FIBS_RatingExperience, FIBS_EmailAddress, FIBS_NoEmail },
+        { 0 },
+        { FIBS_EmailAddress, FIBS_NoEmail },
+        1
+    },
+    [FCM_BLOCK_ShowMoves] = {
+        { FIBS_ShowMovesStart },
+        { FIBS_ShowMovesRoll, FIBS_ShowMovesOther, FIBS_ShowMovesDoubles, FIBS_ShowMovesAccepts,
+          FIBS_ShowMovesRejects, FIBS_ShowMovesWins },
+        { 0 },
+        { 0 }
+    },
+    [FCM_BLOCK_RatingCalc] = {
+        { FIBS_RatingCalcStart },
+        { FIBS_RatingCalcInfo },
+        { 0 },
+        { 0 }
+    },
+    [FCM_BLOCK_SavedMatches] = {
+        { FIBS_SavedMatchesHeader, FIBS_SavedScoreHeader },
+        { FIBS_SavedMatch, FIBS_SavedMatchPlaying },
+        { FIBS_SavedMatchReady },
+        { 0 }
+    }
+};
+
+static void PrepareBlocks( CookieJar *jar )
+{
+    for (int kind = FCM_BLOCK_None + 1; kind < FCM_BLOCK_Kinds; kind++) {
+        CandidateList *lists = jar->blocks[kind];
+        if (!MakeCandidates( &lists[BATCH_Alpha], jar->batches[BATCH_Alpha], BlockSpecs[kind].alpha ))
+            ReleaseCandidates( &lists[BATCH_Alpha] );
+        if (!MakeCandidates( &lists[BATCH_Stars], jar->batches[BATCH_Stars], BlockSpecs[kind].stars ))
+            ReleaseCandidates( &lists[BATCH_Stars] );
+    }
+}
+
+static void ReleaseBlocks( CookieJar *jar )
+{
+    for (int kind = FCM_BLOCK_None + 1; kind < FCM_BLOCK_Kinds; kind++)
+        for (int b = 0; b < BATCH_Count; b++)
+            ReleaseCandidates( &jar->blocks[kind][b] );
+}
+
+static int in_list( const int *cookies, int cookie )
 {
-    int cookie = loop_batch_search( MOTDBatch, message, FIBS_MOTD );
+    for (; *cookies; cookies++)
+        if (*cookies == cookie)
+            return 1;
+    return 0;
+}
+
+// Candidate searches may return a guard, which isn't part of the block.
+static int block_line( int kind, int cookie )
+{
+    return in_list( BlockSpecs[kind].alpha, cookie ) || in_list( BlockSpecs[kind].stars, cookie );
+}
+
+static int block_kind( int cookie )
+{
+    for (int kind = FCM_BLOCK_None + 1; kind < FCM_BLOCK_Kinds; kind++)
+        if (in_list( BlockSpecs[kind].start, cookie ))
+            return kind;
+    return FCM_BLOCK_None;
+}
+
+// Hands the block to the client and starts over.
+static void emit_block( FCMSession *s )
+{
+    FCMBlock *b = s->block;
+    if (b->kind != FCM_BLOCK_None && b->lines > 0)
+        s->blockCallback( b, s->blockContext );
+    b->kind = FCM_BLOCK_None;
+    b->lines = 0;
+    b->more = 0;
+    s->blockUsed = 0;
+}
+
+static void add_block_line( FCMSession *s, int cookie, const char *message )
+{
+    FCMBlock *b = s->block;
+    size_t length = strlen(message);
+
+    // When the record is full, send what we have. The rest follows in another record.
+    if (b->lines == FCM_BLOCK_LINES || s->blockUsed + length + 1 > sizeof(b->buffer)) {
+        int kind = b->kind;
+        b->more = 1;
+        emit_block( s );
+        b->kind = kind;
+    }
+    if (length + 1 > sizeof(b->buffer))
+        length = sizeof(b->buffer) - 1;
+
+    char *text = b->buffer + s->blockUsed;
+    memcpy(text, message, length);
+    text[length] = '\0';
+    s->blockUsed += length + 1;
+    b->text[b->lines] = text;
+    b->cookies[b->lines++] = cookie;
+}
+
+static int block_state_cookies( FCMSession *s, const char *message, int batch )
+{
+    FCMBlock *b = s->block;
+    const CookieDough *d;
+    int cookie;
+
+    if (b->kind != FCM_BLOCK_None) {
+        if (batch != NO_BATCH && (d = candidate_search( &s->jar->blocks[b->kind][batch], message )) != NULL
+            && block_line( b->kind, d->cookie )) {
+            cookie = d->cookie;
+            s->nameAt = d->nameAt;
+            add_block_line( s, cookie, message );
+            if (in_list( BlockSpecs[b->kind].end, cookie ))
+                emit_block( s );
+            return FIBS_Block;
+        }
+        if (!BlockSpecs[b->kind].untilEnd)
+            emit_block( s );
+    }
+
+    if (batch == NO_BATCH)
+        return FIBS_Empty;
+    cookie = run_state_transition( s, engine_search( s, batch, message, FIBS_Unknown ));
+
+    int kind = block_kind( cookie );
+    if (b->kind != FCM_BLOCK_None) {            // still open, waiting for its end
+        if (cookie == FIBS_Unknown) {
+            add_block_line( s, cookie, message );
+            return FIBS_Block;
+        }
+        if (kind == FCM_BLOCK_None)
+            return cookie;
+        emit_block( s );
+    }
+    if (kind == FCM_BLOCK_None)
+        return cookie;
+    b->kind = kind;
+    add_block_line( s, cookie, message );
+    return FIBS_Block;
+}
+
+static int run_state_cookies( FCMSession *s, const char *message )
+{
+    int batch = run_state_batch( message );
+    if (s->block)
+        return block_state_cookies( s, message, batch );
+    if (batch == NO_BATCH)
+        return FIBS_Empty;
+
+    return run_state_transition( s, engine_search( s, batch, message, FIBS_Unknown ));
+}
+
+static int motd_state_cookies( FCMSession *s, const char *message )
+{
+    int cookie = engine_search( s, BATCH_MOTD, message, FIBS_MOTD );
     if (cookie == CLIP_MOTD_END)
-        state = run_state_cookies;
+        s->state = run_state_cookies;
     return cookie;
 }
 
-static int login_state_cookies( const char *message )
+static int login_state_cookies( FCMSession *s, const char *message )
 {
-    int cookie = loop_batch_search( LoginBatch, message, FIBS_PreLogin );
+    int cookie = engine_search( s, BATCH_Login, message, FIBS_PreLogin );
     if (cookie == CLIP_MOTD_BEGIN)
-        state = motd_state_cookies;
+        s->state = motd_state_cookies;
 
     return cookie;
 }
 
-static int uninitialized_state_cookies( const char *message )
+static int uninitialized_state_cookies( FCMSession *s, const char *message )
 {
-    PrepareBatches();
-    state = login_state_cookies;
-    return FIBSCookie( message );
+    s->state = login_state_cookies;
+    return s->state( s, message );
+}
+
+//--- Cookie jars --------------------------------------------------------------
+//
+// All the rules live in a cookie jar, shared by every session. Loading new
+// rules makes a new jar, while the sessions go on using the old one. The new
+// jar is then swapped in, and the old one is freed when no thread reads it any
+// more: a thread classifying a message counts itself in Readers[Epoch & 1]
+// while it uses the jar. After the swap the loader moves Epoch on, so later
+// readers count themselves in the other counter, and waits for the old counter
+// to drop to 0. Readers never wait.
+
+static CookieJar *     Jar        = NULL;
+static unsigned        Epoch      = 0;
+static unsigned        Readers[2] = { 0, 0 };
+static unsigned        Versions   = 0;
+static int             Compact    = 0;                             // make compact rules
+static int             NoRules    = 0;                             // the built-in rules failed, don't retry
+static pthread_mutex_t LoadLock   = PTHREAD_MUTEX_INITIALIZER;     // one loader at a time
+static pthread_mutex_t ReadLock   = PTHREAD_MUTEX_INITIALIZER;     // for LOCKED_READS
+
+// Called with LoadLock held.
+static CookieJar * NewJar()
+{
+    CookieJar *jar = calloc(1, sizeof(CookieJar));
+    if (jar && Compact && (jar->pool = FCM_NewCodePool()) == NULL) {
+        free(jar);
+        return NULL;
+    }
+    return jar;
+}
+
+static void ReleaseJar( CookieJar *jar )
+{
+    if (jar == NULL)
+        return;
+
+// NOTE: The for() loop's body is empty, all work done inside the for() statement.
+#define TRASH_BATCH(startingPoint) { CookieDough * m; for (m = startingPoint; (m); m = ReleaseCookieDough(m)); startingPoint = NULL; }
+    for (int b = 0; b < BATCH_Count; b++)
+        TRASH_BATCH(jar->batches[b])
+#undef TRASH_BATCH
+    ReleaseBlocks( jar );
+    ReleaseSubStates( jar );
+    FCM_FreeCodePool( jar->pool );
+    free(jar->text);
+    free(jar);
+}
+
+static long microseconds_since( const struct timespec *start )
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Makes the candidate lists, and fills in the info. Called with LoadLock held.
+static void FinishJar( CookieJar *jar, const struct timespec *start )
+{
+    const CookieEngine *candidates = find_engine( "candidates" );
+    PrepareBlocks( jar );
+    // Compact rules are meant to save memory, so only make the sub-state lists
+    // if the candidates engine is going to use them. Without them it just
+    // searches like the prefilter engine.
+    if (jar->pool == NULL || LOAD_ACQUIRE(&Engine) == candidates || LOAD_ACQUIRE(&Shadow) == candidates)
+        PrepareSubStates( jar );
+    jar->info.rules = 0;
+    for (int b = 0; b < BATCH_Count; b++)
+        for (CookieDough *ptr = jar->batches[b]; (ptr); ptr = ptr->next)
+            jar->info.rules++;
+
+    jar->memory.rules += sizeof(CookieJar);
+    for (int b = 0; b < BATCH_Count; b++) {
+        for (int sub = 0; sub < RUN_SubStates; sub++)
+            jar->memory.rules += jar->subStates[sub][b].bytes;
+        for (int kind = 0; kind < FCM_BLOCK_Kinds; kind++)
+            jar->memory.rules += jar->blocks[kind][b].bytes;
+    }
+    if (jar->pool) {
+        FCM_TrimCodePool( jar->pool );
+        jar->memory.code = FCM_CodePoolMemory( jar->pool );
+    }
+    jar->info.version = ++Versions;
+    jar->info.loaded = time(NULL);
+    jar->info.microseconds = microseconds_since( start );
+}
+
+// Swaps in the new jar, and frees the old one once no thread reads it.
+// Called with LoadLock held.
+static void PublishJar( CookieJar *jar )
+{
+    CookieJar *old;
+    if (LOCKED_READS) {
+        pthread_mutex_lock(&ReadLock);
+        old = Jar;
+        Jar = jar;
+        pthread_mutex_unlock(&ReadLock);
+    } else {
+        old = EXCHANGE(&Jar, jar);
+        unsigned epoch = ADD_SEQ(&Epoch, 1) - 1;
+        struct timespec pause = { 0, 100000 };
+        while (LOAD_SEQ(&Readers[epoch & 1]) != 0)
+            nanosleep(&pause, NULL);
+    }
+    ReleaseJar( old );
+}
+
+// Makes the jar with the built-in rules, unless there is one already. If
+// that fails, e.g. out of memory, it is not tried again on every message;
+// FCM_LoadRules() or ReleaseFIBSCookieMonster() let it try again.
+static void ReadyJar()
+{
+    if (LOAD_ACQUIRE(&NoRules))
+        return;
+    pthread_mutex_lock(&LoadLock);
+    if (Jar == NULL && !NoRules) {
+        CookieJar *jar = PrepareBatches();
+        if (jar)
+            PublishJar( jar );
+        else
+            STORE_RELEASE(&NoRules, 1);
+    }
+    pthread_mutex_unlock(&LoadLock);
+}
+
+// Returns the current jar, which stays valid until leave_jar(epoch).
+// Returns NULL if the rules could not be prepared, leave_jar() is then not needed.
+static const CookieJar * enter_jar( unsigned *epoch )
+{
+    if (LOAD_ACQUIRE(&Jar) == NULL)
+        ReadyJar();
+
+    if (LOCKED_READS) {
+        pthread_mutex_lock(&ReadLock);
+        if (Jar == NULL)
+            pthread_mutex_unlock(&ReadLock);
+        return Jar;
+    }
+    for (;;) {
+        unsigned e = LOAD_SEQ(&Epoch);
+        ADD_SEQ(&Readers[e & 1], 1);
+        if (LOAD_SEQ(&Epoch) == e) {        // else the loader may have missed us, try again
+            *epoch = e;
+            break;
+        }
+        ADD_SEQ(&Readers[e & 1], -1);
+    }
+    const CookieJar *jar = LOAD_SEQ(&Jar);
+    if (jar == NULL)
+        ADD_SEQ(&Readers[*epoch & 1], -1);
+    return jar;
+}
+
+static void leave_jar( unsigned epoch )
+{
+    if (LOCKED_READS)
+        pthread_mutex_unlock(&ReadLock);
+    else
+        ADD_SEQ(&Readers[epoch & 1], -1);
+}
+
+// Reads rules from the file at path, and puts them in a new jar. See FCM_LoadRules().
+static CookieJar * ReadRules( const char *path )
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open rules file: %s\n", path );
+        return NULL;
+    }
+
+    CookieJar *jar = NewJar();
+    size_t size = 0, capacity = 0;
+    char *text = NULL;
+    int outOfMemory = 0;
+    for (;;) {
+        if (size + 1 >= capacity) {
+            size_t bigger = capacity ? capacity * 2 : 16384;
+            char *grown = realloc(text, bigger);
+            if ((outOfMemory = (grown == NULL)))
+                break;
+            text = grown;
+            capacity = bigger;
+        }
+        size_t n = fread(text + size, 1, capacity - size - 1, file);
+        if (n == 0)
+            break;
+        size += n;
+    }
+    int failed = ferror(file) || outOfMemory || jar == NULL;
+    fclose(file);
+    if (failed) {
+        free(text);
+        ReleaseJar( jar );
+        fprintf(stderr, "Cannot read rules file: %s\n", path );
+        return NULL;
+    }
+    text[size] = '\0';
+    jar->text = text;
+    jar->memory.rules += capacity;
+
+    CookieDough *last[BATCH_Count] = { NULL };
+    int number = 0;
+    for (char *line = text, *next; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        if (*next)
+            *next++ = '\0';
+        number++;
+
+        line += strspn(line, " \t");
+        if (*line == '\0' || *line == '\r' || *line == '#')
+            continue;
+
+        size_t length = strcspn(line, " \t");
+        int batch = BATCH_Count;
+        while (--batch >= 0)
+            if (strncmp(line, BatchNames[batch], length) == 0 && BatchNames[batch][length] == '\0')
+                break;
+        line += length;
+        line += strspn(line, " \t");
+        length = strcspn(line, " \t");
+        int cookie = FCM_CookieByName(line, length);
+        char *re = strchr(line + length, '"');
+        char *end = strrchr(line + length, '"');
+
+        CookieDough *dough = NULL;
+        if (batch >= 0 && cookie != FIBS_BAD_COOKIE && re && end > re) {
+            *end = '\0';
+            dough = AddCookieDough(jar, cookie, re + 1);
+        }
+        if (dough == NULL) {
+            fprintf(stderr, "%s:%d: bad rule\n", path, number );
+            ReleaseJar( jar );
+            return NULL;
+        }
+        if (last[batch])
+            last[batch]->next = dough;
+        else
+            jar->batches[batch] = dough;
+        last[batch] = dough;
+    }
+
+    // A batch without rules would make every message of its state unknown.
+    for (int batch = 0; batch < BATCH_Count; batch++)
+        if (jar->batches[batch] == NULL) {
+            fprintf(stderr, "%s: no %s rules\n", path, BatchNames[batch] );
+            ReleaseJar( jar );
+            return NULL;
+        }
+    FinishJar( jar, &start );
+    return jar;
+}
+
+// Loads the rules file at path, see the README for its format, or the built-in
+// rules if path is NULL, and makes the new rules current. Messages already
+// being classified finish with the old rules. May be called from any thread,
+// but not from a block callback or an observer. Returns the version of the new
+// rules, or 0 if the file has errors, which are printed to stderr. The current
+// rules are then kept.
+unsigned FCM_LoadRules(const char * path)
+{
+    pthread_mutex_lock(&LoadLock);
+    CookieJar *jar = path ? ReadRules( path ) : PrepareBatches();
+    unsigned version = 0;
+    if (jar) {
+        version = jar->info.version;
+        PublishJar( jar );
+        STORE_RELEASE(&NoRules, 0);
+    }
+    pthread_mutex_unlock(&LoadLock);
+    return version;
+}
+
+// Writes the current rules to the file at path, in the format FCM_LoadRules() reads.
+// Returns 0 if the file could not be written.
+int FCM_SaveRules(const char * path)
+{
+    unsigned epoch;
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return 0;
+
+    const CookieJar *jar = enter_jar( &epoch );
+    if (jar) {
+        fprintf(file, "# FIBSCookieMonster rules, version %u: batch, cookie, \"regex\"\n", jar->info.version);
+        for (int b = 0; b < BATCH_Count; b++) {
+            fprintf(file, "\n");
+            for (CookieDough *ptr = jar->batches[b]; (ptr); ptr = ptr->next)
+                fprintf(file, "%-8s %-32s \"%s\"\n", BatchNames[b], FCM_CookieName(ptr->cookie), ptr->re);
+        }
+        leave_jar( epoch );
+    }
+    return fclose(file) == 0 && jar != NULL;
+}
+
+// Fills in info about the current rules. Returns 0 if there are none yet.
+int FCM_RulesInfo(FCMRulesInfo * info)
+{
+    unsigned epoch;
+    const CookieJar *jar = enter_jar( &epoch );
+    if (jar == NULL)
+        return 0;
+    *info = jar->info;
+    leave_jar( epoch );
+    return 1;
+}
+
+// Tells the memory used by the current rules. Returns 0 if there are none yet.
+int FCM_RulesMemory(FCMMemory * memory)
+{
+    unsigned epoch;
+    const CookieJar *jar = enter_jar( &epoch );
+    if (jar == NULL)
+        return 0;
+    *memory = jar->memory;
+    pthread_mutex_lock(&RegcompLock);
+    memory->regex += jar->lateRegex;
+    pthread_mutex_unlock(&RegcompLock);
+    leave_jar( epoch );
+    return 1;
+}
+
+// Makes rules loaded from now on compact, or not. Compact rules are compiled
+// to a few bytes of code each, and only those the compact matcher can't handle
+// get a regex_t. The reference engine still runs regexec(), so it compiles the
+// regex of a compact rule the first time it tries the rule; the memory is only
+// saved with the other engines. The run sub-state lists are only made for
+// compact rules if the candidates engine is selected when they are loaded.
+// Call FCM_LoadRules() to change the current rules.
+void FCM_SetCompactRules(int compact)
+{
+    pthread_mutex_lock(&LoadLock);
+    Compact = compact;
+    pthread_mutex_unlock(&LoadLock);
+}
+
+//--- Differential fuzzing -----------------------------------------------------
+//
+// Makes random lines from the regex of every rule, more or less matching it,
+// and checks that an engine gives the same cookies as the reference engine for
+// them in every sub-state. Handles the regexes the rules use: literals, '.',
+// brackets, groups, alternatives and repeats.
+
+typedef struct Sampler {
+    char    *out;
+    size_t   used;
+    size_t   size;
+    unsigned seed;
+} Sampler;
+
+static unsigned sample_random( Sampler *s, unsigned n )
+{
+    s->seed ^= s->seed << 13;           // xorshift
+    s->seed ^= s->seed >> 17;
+    s->seed ^= s->seed << 5;
+    return n ? s->seed % n : 0;
+}
+
+static void sample_char( Sampler *s, char c )
+{
+    if (s->used + 1 < s->size)
+        s->out[s->used++] = c;
+}
+
+static void sample_junk( Sampler *s, unsigned most )
+{
+    static const char junk[] = "abcXYZ019 :.-*";
+    for (unsigned n = sample_random( s, most + 1 ); n > 0; n--)
+        sample_char( s, junk[sample_random( s, sizeof(junk) - 1 )] );
+}
+
+// Fills in the characters the bracket expression at p matches, and returns its end.
+static const char * bracket_set( const char *p, char set[256] )
+{
+    int negate = (*++p == '^');
+    memset(set, 0, 256);
+    if (negate)
+        p++;
+    for (const char *first = p; *p && (*p != ']' || p == first); p++) {
+        unsigned char lo = *p, hi = *p;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            hi = p[2];
+            p += 2;
+        }
+        for (int c = lo; c <= hi; c++)
+            set[c] = 1;
+    }
+    if (negate)
+        for (int c = 0; c < 256; c++)
+            set[c] = !set[c];
+    return *p ? p + 1 : p;
+}
+
+static const char * atom_end( const char *p )
+{
+    char set[256];
+    int depth = 0;
+    if (*p == '\\' && p[1])
+        return p + 2;
+    if (*p == '[')
+        return bracket_set( p, set );
+    if (*p != '(')
+        return p + 1;
+    do {
+        if (*p == '\\' && p[1]) p++;
+        else if (*p == '(') depth++;
+        else if (*p == ')') depth--;
+        p++;
+    } while (*p && depth > 0);
+    return p;
+}
+
+static void sample_alternatives( Sampler *s, const char *p, const char *end );
+
+static void sample_atom( Sampler *s, const char *p, const char *end )
+{
+    char set[256];
+    int n = 0;
+
+    switch (*p) {
+    case '\\':
+        sample_char( s, p[1] );
+        break;
+    case '[':                           // a printable character of the set
+        bracket_set( p, set );
+        for (int c = ' '; c < 127; c++)
+            n += set[c];
+        for (int c = ' ', k = (int)sample_random( s, n ); n > 0 && c < 127; c++)
+            if (set[c] && k-- == 0) {
+                sample_char( s, (char)c );
+                break;
+            }
+        break;
+    case '(':
+        sample_alternatives( s, p + 1, end - 1 );
+        break;
+    case '.':
+        sample_char( s, (char)(' ' + sample_random( s, 95 )) );
+        break;
+    case '^':
+    case '$':
+        break;
+    default:
+        sample_char( s, *p );
+    }
+}
+
+static void sample_sequence( Sampler *s, const char *p, const char *end )
+{
+    while (p < end) {
+        const char *next = atom_end( p ), *q = next;
+        int min = 1, max = 1;
+        if (q < end && *q == '*') { min = 0; max = 3; q++; }
+        else if (q < end && *q == '+') { max = 4; q++; }
+        else if (q < end && *q == '?') { min = 0; q++; }
+        else if (q < end && *q == '{') {
+            char *e;
+            max = min = (int)strtol(q + 1, &e, 10);
+            if (*e == ',')
+                max = e[1] == '}' ? min + 3 : (int)strtol(e + 1, &e, 10);
+            q = strchr(q, '}') ? strchr(q, '}') + 1 : end;
+        }
+        if (max > min + 3)
+            max = min + 3;
+        for (int n = min + (int)sample_random( s, max - min + 1 ); n > 0; n--)
+            sample_atom( s, p, next );
+        p = q;
+    }
+}
+
+static void sample_alternatives( Sampler *s, const char *p, const char *end )
+{
+    const char *bars[32];
+    int n = 0;
+    for (const char *q = p; q < end && n < 32; q = atom_end( q ))
+        if (*q == '|')
+            bars[n++] = q;
+    int k = (int)sample_random( s, n + 1 );
+    sample_sequence( s, k == 0 ? p : bars[k - 1] + 1, k == n ? end : bars[k] );
+}
+
+// Makes a line in s->out from re, and now and then spoils it a little.
+static void sample_rule( Sampler *s, const char *re )
+{
+    size_t length = strlen(re);
+    s->used = 0;
+    if (re[0] != '^')
+        sample_junk( s, 4 );
+    sample_alternatives( s, re, re + length );
+    if (length == 0 || re[length - 1] != '$')
+        sample_junk( s, 6 );
+
+    if (s->used > 0 && sample_random( s, 4 ) == 0) {
+        size_t at = sample_random( s, (unsigned)s->used );
+        switch (sample_random( s, 3 )) {
+        case 0:  memmove(s->out + at, s->out + at + 1, s->used - at - 1); s->used--; break;
+        case 1:  s->out[at] = (char)(' ' + sample_random( s, 95 )); break;
+        default: s->used = at; break;
+        }
+    }
+    s->out[s->used] = '\0';
+}
+
+static const char * cookie_name( int cookie )
+{
+    const char *name = FCM_CookieName( cookie );
+    return name ? name : "?";
+}
+
+// Checks the engine called name against the reference engine, with
+// linesPerRule lines made from every rule. Disagreements and a summary are
+// printed to report, if not NULL. Returns the number of disagreements, or -1
+// if there is no such engine or no rules.
+int FCM_FuzzEngine(const char * name, int linesPerRule, unsigned seed, FILE * report)
+{
+    const CookieEngine *engine = find_engine( name ), *reference = &Engines[0];
+    unsigned epoch;
+    if (engine == NULL)
+        return -1;
+    const CookieJar *jar = enter_jar( &epoch );
+    if (jar == NULL)
+        return -1;
+
+    char line[512];
+    Sampler s = { line, 0, sizeof(line), seed ? seed : 1 };
+    long lines = 0, hits = 0;
+    int disagreements = 0;
+    for (int b = 0; b < BATCH_Count; b++)
+        for (CookieDough *rule = jar->batches[b]; (rule); rule = rule->next)
+            for (int i = 0; i < linesPerRule; i++) {
+                sample_rule( &s, rule->re );
+                int batch = b >= BATCH_Alpha ? run_state_batch( line ) : b;
+                if (batch == NO_BATCH)
+                    continue;
+                lines++;
+                for (int sub = 0; sub < (b >= BATCH_Alpha ? RUN_SubStates : 1); sub++) {
+                    int expected = dough_cookie( reference->search( jar, batch, sub, line ), FIBS_Unknown );
+                    int cookie = dough_cookie( engine->search( jar, batch, sub, line ), FIBS_Unknown );
+                    if (sub == 0 && expected == rule->cookie)
+                        hits++;
+                    if (cookie != expected && disagreements++ < 100 && report)
+                        fprintf(report, "%s \"%s\", sub-state %d: \"%s\" is %s, not %s\n", cookie_name( rule->cookie ),
+                                rule->re, sub, line, cookie_name( expected ), cookie_name( cookie ));
+                }
+            }
+    leave_jar( epoch );
+
+    if (report)
+        fprintf(report, "%s: %ld lines, %ld of them %s, %d disagreements\n", name, lines, hits,
+                "classified as the rule they were made from", disagreements);
+    return disagreements;
 }
 
 /* Returns a message ID (see FIBSCookieMonster.h and clip.h), or -1 if
@@ -151,7 +1610,7 @@ static int uninitialized_state_cookies( const char *message )
  */
 int FIBSCookie(const char * message)
 {
-    return state( message );
+    return FCM_SessionCookie( &DefaultSession, message );
 }
 
 // Call this function to reset before reconnecting to FIBS.
@@ -165,44 +1624,310 @@ int FIBSCookie(const char * message)
 
 void ResetFIBSCookieMonster()
 {
-    if (state == uninitialized_state_cookies)
-        PrepareBatches();
-    else
-        state = login_state_cookies;
+    FCM_ResetSession( &DefaultSession );
 }
 
 // Call this to release the memory used by FIBSCookieMonster.
 // You normally don't need to use this function, since everything
 // will be cleaned up when your application terminates.
+//
+// The batches are shared by all sessions, so make sure no other session
+// is in use. Sessions will prepare the built-in rules on their next message.
 
 void ReleaseFIBSCookieMonster()
 {
-    if (state == uninitialized_state_cookies)
-        return;
+    pthread_mutex_lock(&LoadLock);
+    PublishJar( NULL );                 // waits for classifications still using the rules
+    STORE_RELEASE(&NoRules, 0);
+    pthread_mutex_unlock(&LoadLock);
+    ClearSession( &DefaultSession );
+    DefaultSession.state = uninitialized_state_cookies;
+}
 
-// NOTE: The for() loop's body is empty, all work done inside the for() statement.
-#define TRASH_BATCH(startingPoint) { CookieDough * m; for (m = startingPoint; (m); m = ReleaseCookieDough(m)); startingPoint = NULL; }
-    TRASH_BATCH(AlphaBatch)
-    TRASH_BATCH(StarsBatch)
-    TRASH_BATCH(NumericBatch)
-    TRASH_BATCH(LoginBatch)
-    TRASH_BATCH(MOTDBatch)
-#undef TRASH_BATCH
-    state = uninitialized_state_cookies;
+//--- Sessions ---------------------------------------------------------------
+//
+// Use sessions when one process talks to FIBS over several connections.
+// Each connection gets its own FCMSession, the batches are shared.
+
+FCMSession * FCM_NewSession()
+{
+    FCMSession * s = malloc(sizeof(FCMSession));
+    if (s == NULL)
+        return NULL;
+    s->state = uninitialized_state_cookies;
+    s->substate = RUN_Lobby;
+    s->jar = NULL;
+    s->shadowTicks = 0;
+    s->nameAt = -1;
+    s->block = NULL;
+    s->blockUsed = 0;
+    s->blockCallback = NULL;
+    s->blockContext = NULL;
+    s->observer = NULL;
+    s->observerContext = NULL;
+    return s;
+}
+
+// Bytes used by the session, not counting the rules all sessions share.
+size_t FCM_SessionMemory(const FCMSession * s)
+{
+    return sizeof(FCMSession) + (s->block ? sizeof(FCMBlock) : 0);
+}
+
+void FCM_FreeSession(FCMSession * s)
+{
+    free(s->block);
+    s->block = NULL;
+    if (s != &DefaultSession)
+        free(s);
+}
+
+// Forgets everything the session learned from its messages, dropping any
+// half collected block. Keeps the callbacks and the block record.
+static void ClearSession( FCMSession *s )
+{
+    s->substate = RUN_Lobby;
+    s->jar = NULL;
+    s->shadowTicks = 0;
+    s->nameAt = -1;
+    if (s->block) {
+        s->block->kind = FCM_BLOCK_None;
+        s->block->more = 0;
+        s->block->lines = 0;
+    }
+    s->blockUsed = 0;
+}
+
+void FCM_ResetSession(FCMSession * s)
+{
+    if (LOAD_ACQUIRE(&Jar) == NULL)
+        ReadyJar();
+    ClearSession( s );
+    s->state = login_state_cookies;
+}
+
+// Pass a callback to collect blocks, or NULL to stop collecting them.
+// Returns 0 if out of memory.
+int FCM_SetBlockCallback(FCMSession * s, FCMBlockCallback callback, void * context)
+{
+    if (callback == NULL) {
+        if (s->block)
+            FCM_FlushBlock( s );
+        free(s->block);
+        s->block = NULL;
+        return 1;
+    }
+    if (s->block == NULL) {
+        if ((s->block = malloc(sizeof(FCMBlock))) == NULL)
+            return 0;
+        s->block->kind = FCM_BLOCK_None;
+        s->block->lines = 0;
+        s->block->more = 0;
+        s->blockUsed = 0;
+    }
+    s->blockCallback = callback;
+    s->blockContext = context;
+    return 1;
+}
+
+// Sends the block being collected, if any, without waiting for the line that ends it.
+void FCM_FlushBlock(FCMSession * s)
+{
+    if (s->block)
+        emit_block( s );
+}
+
+// The observer is called with every cookie the session hands out, after
+// the session has moved to its next state. Pass NULL to remove it.
+void FCM_SetObserver(FCMSession * s, FCMObserver observer, void * context)
+{
+    s->observer = observer;
+    s->observerContext = context;
+}
+
+static int observe( FCMSession *s, int cookie, const char *message )
+{
+    if (s->observer)
+        s->observer( cookie, message, s->observerContext );
+    return cookie;
+}
+
+// Where the player name starts in the message last classified by the session,
+// if the rule that matched it says so, or -1.
+int FCM_SessionNameAt(const FCMSession * s)
+{
+    return s->nameAt;
+}
+
+int FCM_SessionCookie(FCMSession * s, const char * message)
+{
+    unsigned epoch;
+    if ((s->jar = enter_jar( &epoch )) == NULL)
+        return FIBS_BAD_COOKIE;
+    s->nameAt = -1;
+    int cookie = s->state( s, message );
+    leave_jar( epoch );
+    return observe( s, cookie, message );
+}
+
+// Classifies one line from each of count sessions, as if each line was passed
+// to FCM_SessionCookie() in turn. The same session may appear more than once,
+// its lines are then classified in order. All the lines are classified with
+// the same rules, even if new rules are loaded meanwhile.
+
+void FCM_SessionCookies(FCMSession * const sessions[], const char * const messages[], int cookies[], int count)
+{
+    unsigned epoch;
+    const CookieJar * jar = enter_jar( &epoch );
+
+    for (int i = 0; i < count; i++) {
+        FCMSession * s = sessions[i];
+        if (jar == NULL) {
+            cookies[i] = FIBS_BAD_COOKIE;
+            continue;
+        }
+        s->jar = jar;
+        s->nameAt = -1;
+        cookies[i] = observe( s, s->state( s, messages[i] ), messages[i] );
+    }
+    if (jar)
+        leave_jar( epoch );
+}
+
+//--- Snapshots ----------------------------------------------------------------
+//
+// A snapshot holds where the session is in the dispatch table, and the block
+// it is collecting. The numbers are stored little endian, so a snapshot can
+// be restored on another machine too. Layout, version 1:
+//
+//   'F' 'C' version state substate blocks kind more   one byte each
+//   shadowTicks                                        4 bytes
+//   lines used                                         2 bytes each
+//   cookie offset                                      2 bytes each, per line
+//   the text of the lines, used bytes
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER  16
+
+static const state_function SnapshotStates[] = {
+    uninitialized_state_cookies,
+    login_state_cookies,
+    motd_state_cookies,
+    run_state_cookies,
+    logout_state_cookies
+};
+#define SNAPSHOT_STATES ((int)(sizeof(SnapshotStates) / sizeof(SnapshotStates[0])))
+
+static unsigned char *put16( unsigned char *p, unsigned n )
+{
+    p[0] = (unsigned char)n;
+    p[1] = (unsigned char)(n >> 8);
+    return p + 2;
+}
+
+static unsigned get16( const unsigned char *p )
+{
+    return p[0] | (unsigned)p[1] << 8;
+}
+
+// Saves the session in buffer. Returns the bytes used, at most
+// FCM_SESSION_SNAPSHOT, or 0 if size is too small.
+size_t FCM_SaveSession(const FCMSession * s, void * buffer, size_t size)
+{
+    const FCMBlock *b = s->block;
+    int lines = b ? b->lines : 0;
+    size_t used = b ? s->blockUsed : 0;
+    size_t length = SNAPSHOT_HEADER + 4 * (size_t)lines + used;
+    if (size < length)
+        return 0;
+
+    int state = 0;
+    while (state < SNAPSHOT_STATES - 1 && SnapshotStates[state] != s->state)
+        state++;
+
+    unsigned char *p = buffer;
+    *p++ = 'F';
+    *p++ = 'C';
+    *p++ = SNAPSHOT_VERSION;
+    *p++ = (unsigned char)state;
+    *p++ = (unsigned char)s->substate;
+    *p++ = b != NULL;
+    *p++ = (unsigned char)(b ? b->kind : FCM_BLOCK_None);
+    *p++ = (unsigned char)(b ? b->more : 0);
+    p = put16( put16( p, s->shadowTicks & 0xFFFF ), s->shadowTicks >> 16 );
+    p = put16( put16( p, (unsigned)lines ), (unsigned)used );
+    for (int i = 0; i < lines; i++)
+        p = put16( put16( p, (unsigned)b->cookies[i] ), (unsigned)(b->text[i] - b->buffer) );
+    if (used)
+        memcpy(p, b->buffer, used);
+    return length;
+}
+
+// Puts the session back where a snapshot left it. The callbacks and the
+// observer are not in the snapshot, they stay as set on the session. A
+// snapshot made while collecting blocks needs a block callback set first.
+// Returns FCM_SNAPSHOT_OK, or one of the errors in FIBSCookieMonster.h, and
+// then the session is unchanged. Doesn't allocate or print anything.
+int FCM_RestoreSession(FCMSession * s, const void * buffer, size_t size)
+{
+    const unsigned char *p = buffer;
+    if (size < SNAPSHOT_HEADER || p[0] != 'F' || p[1] != 'C' || p[2] != SNAPSHOT_VERSION)
+        return FCM_SNAPSHOT_VERSION;
+    int state = p[3], substate = p[4], blocks = p[5], kind = p[6], more = p[7];
+    unsigned ticks = get16( p + 8 ) | get16( p + 10 ) << 16;
+    unsigned lines = get16( p + 12 ), used = get16( p + 14 );
+    const unsigned char *offsets = p + SNAPSHOT_HEADER, *text = offsets + 4 * lines;
+
+    if (state >= SNAPSHOT_STATES || substate >= RUN_SubStates || kind >= FCM_BLOCK_Kinds
+            || lines > FCM_BLOCK_LINES || used > sizeof(s->block->buffer)
+            || size < SNAPSHOT_HEADER + 4 * lines + used || (kind == FCM_BLOCK_None && lines > 0)
+            || (used > 0 && text[used - 1] != '\0'))
+        return FCM_SNAPSHOT_DAMAGED;
+    for (unsigned i = 0; i < lines; i++)
+        if (get16( offsets + 4 * i + 2 ) >= used)
+            return FCM_SNAPSHOT_DAMAGED;
+    if (blocks && s->block == NULL)
+        return FCM_SNAPSHOT_NO_BLOCKS;
+
+    s->state = SnapshotStates[state];
+    s->substate = substate;
+    s->shadowTicks = ticks;
+    s->nameAt = -1;
+    if (s->block) {
+        FCMBlock *b = s->block;
+        b->kind = kind;
+        b->more = more;
+        b->lines = (int)lines;
+        for (unsigned i = 0; i < lines; i++) {
+            b->cookies[i] = (int)get16( offsets + 4 * i );
+            b->text[i] = b->buffer + get16( offsets + 4 * i + 2 );
+        }
+        memcpy(b->buffer, text, used);
+        s->blockUsed = used;
+    }
+    return FCM_SNAPSHOT_OK;
 }
 
 // Initialize stuff, ready to start pumping out cookies by the thousands.
 // Note that the order of items in this function is important, in some cases
 // messages are very similar and are differentiated by depending on the
 // order the batch is processed.
-static void PrepareBatches()
+//
+// Returns a jar with the built-in rules, or NULL. Called with LoadLock held.
+static CookieJar * PrepareBatches()
 {
     CookieDough * current;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    CookieJar * jar = NewJar();
+    if (jar == NULL)
+        return NULL;
 
-#define START_BATCH(map, message, re) current = map = AddCookieDough(message, re); if (current == NULL) return;
-#define ADD_DOUGH(message, re) current = current->next = AddCookieDough(message, re); if (current == NULL) return;
+#define START_BATCH(map, message, re) current = jar->batches[map] = AddCookieDough(jar, message, re); if (current == NULL) goto failed;
+#define ADD_DOUGH(message, re) current = current->next = AddCookieDough(jar, message, re); if (current == NULL) goto failed;
 
-    START_BATCH(AlphaBatch, FIBS_Board,   "^board:[a-zA-Z_<>]+:[a-zA-Z_<>]+:[0-9:\\-]+$");
+    START_BATCH(BATCH_Alpha, FIBS_Board,   "^board:[a-zA-Z_<>]+:[a-zA-Z_<>]+:[0-9:\\-]+$");
     ADD_DOUGH(FIBS_BAD_Board,             "^board:");
     ADD_DOUGH(FIBS_YouRoll,               "^You roll [1-6] and [1-6]");
     ADD_DOUGH(FIBS_PlayerRolls,           "^[a-zA-Z_<>]+ rolls [1-6] and [1-6]");
@@ -369,7 +2094,7 @@ static void PrepareBatches()
     ADD_DOUGH(FIBS_NoInfo,                "^No information found on user");
 
     //--- Numeric messages ---------------------------------------------------
-    START_BATCH(NumericBatch, CLIP_WHO_INFO, "^5 [^ ]+ - - [01]");
+    START_BATCH(BATCH_Numeric, CLIP_WHO_INFO, "^5 [^ ]+ - - [01]");
     ADD_DOUGH(CLIP_WHO_INFO,           "^5 [^ ]+ [^ ]+ - [01]");
     ADD_DOUGH(CLIP_WHO_INFO,           "^5 [^ ]+ - [^ ]+ [01]");
 
@@ -399,7 +2124,7 @@ static void PrepareBatches()
     ADD_DOUGH(CLIP_MESSAGE_SAVED,      "^11 [a-zA-Z_<>]+$");
     
     //--- '**' messages ------------------------------------------------------
-    START_BATCH(StarsBatch, FIBS_Username, "^\\*\\* User");
+    START_BATCH(BATCH_Stars, FIBS_Username, "^\\*\\* User");
     ADD_DOUGH(FIBS_Junk,                   "^\\*\\* You tell ");                // "** You tell PLAYER: xxxxx"
     ADD_DOUGH(FIBS_YouGag,                 "^\\*\\* You gag");
     ADD_DOUGH(FIBS_YouUngag,               "^\\*\\* You ungag");
@@ -482,39 +2207,91 @@ static void PrepareBatches()
     ADD_DOUGH(FIBS_CantGagYourself,        "^\\*\\* You talk too much, don't you\\?");
     ADD_DOUGH(FIBS_CantBlindYourself,      "^\\*\\* You can't read this message now, can you\\?");
 
-    START_BATCH(LoginBatch, FIBS_LoginPrompt, "^login:");
+    START_BATCH(BATCH_Login, FIBS_LoginPrompt, "^login:");
     ADD_DOUGH(CLIP_WELCOME,                   "^1 [a-zA-Z_<>]+ [0-9]+ ");
     ADD_DOUGH(CLIP_OWN_INFO,                  "^2 [a-zA-Z_<>]+ [01] [01]");
     ADD_DOUGH(CLIP_MOTD_BEGIN,                "^3$");
     ADD_DOUGH(FIBS_FailedLogin,               "^> [0-9]+");        // bogus CLIP messages sent after a failed login
 
     // Only interested in one message here, but we still use a message list for simplicity and consistency.
-    START_BATCH(MOTDBatch, CLIP_MOTD_END,  "^4$");
+    START_BATCH(BATCH_MOTD,  CLIP_MOTD_END,  "^4$");
 
-    state = login_state_cookies;
+    FinishJar( jar, &start );
+    return jar;
 #undef START_BATCH
 #undef ADD_DOUGH
+
+failed:
+    ReleaseJar( jar );
+    return NULL;
 }
 
 // Allocates memory for a new CookieDough struct, initializes it, and returns pointer.
-static CookieDough * AddCookieDough(int message, const char * re)
+// The memory used is added to the jar's.
+static CookieDough * AddCookieDough(CookieJar * jar, int message, const char * re)
 {
     CookieDough * newDough = malloc(sizeof(CookieDough));
     if (newDough == NULL)
         return NULL;
-    
-    int result = regcomp(&(newDough->regex), re, REG_EXTENDED | REG_NOSUB);
-    if (result)            // we discard the result code, so...
-    {
-        free(newDough);    // ...set a breakpoint here, if you're having initialization problems.
-        fprintf(stderr, "Cannot initialise regex: %s\n", re );
-        return NULL;
+
+    newDough->pool = jar->pool;
+    newDough->code = jar->pool ? FCM_CompileCompact(jar->pool, re) : FCM_NO_CODE;
+    newDough->regex = NULL;
+    if (newDough->code != FCM_NO_CODE)
+        jar->memory.compactRules++;
+    else {
+        size_t before = HEAP_IN_USE();
+        newDough->regex = malloc(sizeof(regex_t));
+        int result = newDough->regex ? regcomp(newDough->regex, re, REG_EXTENDED | REG_NOSUB) : REG_ESPACE;
+        if (result)            // we discard the result code, so...
+        {
+            free(newDough->regex);
+            free(newDough);    // ...set a breakpoint here, if you're having initialization problems.
+            fprintf(stderr, "Cannot initialise regex: %s\n", re );
+            return NULL;
+        }
+        size_t after = HEAP_IN_USE();
+        jar->memory.regex += after > before ? after - before : sizeof(regex_t);
     }
+    jar->memory.rules += sizeof(CookieDough);
     newDough->cookie = message;
+    newDough->re = re;
+
+    char prefix[MAX_PREFIX];
+    int n = literal_prefix( re, prefix );
+    newDough->nameAt = (short)name_offset( re, n );
+    newDough->mustStart = (n > 0);
+    if (n > 0) {
+        n = n < (int)sizeof(newDough->must) - 1 ? n : (int)sizeof(newDough->must) - 1;
+        memcpy(newDough->must, prefix, n);
+        newDough->must[n] = '\0';
+    } else {
+        required_literal( re, newDough->must, sizeof(newDough->must) );
+    }
     newDough->next = NULL;
     return newDough;
 }
 
+// Compiles the regex of a compact rule for dough_regexec(). Returns NULL if out of memory.
+static regex_t * late_regex( const CookieJar *jar, const CookieDough *d )
+{
+    pthread_mutex_lock(&RegcompLock);
+    regex_t *regex = d->regex;          // another thread may have beaten us to it
+    if (regex == NULL && (regex = malloc(sizeof(regex_t))) != NULL) {
+        size_t before = HEAP_IN_USE();
+        if (regcomp(regex, d->re, REG_EXTENDED | REG_NOSUB) == 0) {
+            size_t after = HEAP_IN_USE();
+            ((CookieJar *)jar)->lateRegex += after > before ? after - before : sizeof(regex_t);
+            STORE_RELEASE(&((CookieDough *)d)->regex, regex);
+        } else {
+            free(regex);
+            regex = NULL;
+        }
+    }
+    pthread_mutex_unlock(&RegcompLock);
+    return regex;
+}
+
 // Releases the CookieDough struct passed in the parameter, returning
 // that struct's next pointer. Also calls regfree() to release the memory
 // allocated by regcomp().
@@ -524,7 +2301,9 @@ static CookieDough * ReleaseCookieDough(CookieDough * theDough)
         return NULL;
 
     CookieDough * nextDough = theDough->next;
-    regfree(&(theDough->regex));
+    if (theDough->regex)
+        regfree(theDough->regex);
+    free(theDough->regex);
     free(theDough);
     return nextDough;
 }
@@ -580,6 +2359,25 @@ int main(int UNUSED(argc), UNUSED(const char * argv[]))
     int i;
     char message[4096];
 
+    // Pretend the rules could not be prepared: every line must then get
+    // FIBS_BAD_COOKIE, also when several sessions are classified at once.
+    {
+        FCMSession *a = FCM_NewSession(), *b = FCM_NewSession();
+        FCMSession * const sessions[] = { a, b, a };
+        const char * const lines[] = { "1 TESTAPP 1041253132 host", "** You are now playing.", "3" };
+        int bad[3];
+        STORE_RELEASE(&NoRules, 1);
+        FCM_SessionCookies( sessions, lines, bad, 3 );
+        STORE_RELEASE(&NoRules, 0);
+        for (i = 0; i < 3; i++)
+            if (bad[i] != FIBS_BAD_COOKIE) {
+                printf("without rules, line %d got %d, not FIBS_BAD_COOKIE\n", i + 1, bad[i]);
+                return 1;
+            }
+        FCM_FreeSession( a );
+        FCM_FreeSession( b );
+    }
+
     /* (Oystein) This initsialisation is called in the first call to FIBSCookie anyway, this call may be redundant */
     ResetFIBSCookieMonster();
 
@@ -600,3 +2398,149 @@ int main(int UNUSED(argc), UNUSED(const char * argv[]))
     return 0;
 }
 #endif
+
+#if TEST_SNAPSHOTS
+// Checks that a session restored from a snapshot carries on exactly like the
+// session the snapshot was taken from. Classifies a captured session, see
+// above, once straight through, and then again with a snapshot taken and
+// restored into a new session at random lines, with and without blocks.
+// The cookies and the blocks must be the same, and a snapshot of the new
+// session must be the same as the one it was restored from. Then resets
+// sessions, half of them in the middle of a block, and runs them again from
+// the start.
+//
+// % ThisTestApp [snapshots] < ~/Documents/fibs_log.txt
+//
+// Exits with 1 if a restored session went astray.
+
+#define MAX_LINES  100000
+#define MAX_EVENTS 100000
+
+typedef struct BlockLog {
+    int           line;                 // being classified
+    int           count;
+    unsigned long events[MAX_EVENTS];   // a hash of each block, in order
+} BlockLog;
+
+static void log_block( const FCMBlock *b, void *context )
+{
+    BlockLog *log = context;
+    unsigned long h = (unsigned long)log->line * 31 + (unsigned long)b->kind * 7 + (unsigned long)b->more;
+    for (int i = 0; i < b->lines; i++) {
+        h = h * 31 + (unsigned)b->cookies[i];
+        for (const char *c = b->text[i]; *c; c++)
+            h = h * 31 + (unsigned char)*c;
+    }
+    if (log->count < MAX_EVENTS)
+        log->events[log->count++] = h;
+}
+
+static void run_lines( FCMSession *s, char **lines, int from, int to, int cookies[], BlockLog *log )
+{
+    for (int i = from; i < to; i++) {
+        log->line = i;
+        cookies[i] = FCM_SessionCookie( s, lines[i] );
+    }
+    log->line = to;
+}
+
+int main(int argc, const char * argv[])
+{
+    static char *lines[MAX_LINES];
+    static int expected[MAX_LINES], cookies[MAX_LINES];
+    static BlockLog want, got;
+    int snapshots = argc > 1 ? atoi(argv[1]) : 100;
+    int count = 0, failures = 0;
+    char message[4096];
+
+    while (count < MAX_LINES && fgets(message, sizeof(message), stdin)) {
+        message[strcspn(message, "\r\n")] = '\0';
+        if ((lines[count] = strdup(message)) == NULL)
+            return 2;
+        count++;
+    }
+
+    srand(1);
+    for (int blocks = 0; blocks < 2; blocks++) {
+        FCMSession *s = FCM_NewSession();
+        want.count = 0;
+        if (blocks)
+            FCM_SetBlockCallback( s, log_block, &want );
+        run_lines( s, lines, 0, count, expected, &want );
+        FCM_FlushBlock( s );
+        FCM_FreeSession( s );
+
+        for (int n = 0; n < snapshots; n++) {
+            unsigned char snapshot[FCM_SESSION_SNAPSHOT], again[FCM_SESSION_SNAPSHOT];
+            int at = rand() % (count + 1);
+            FCMSession *before = FCM_NewSession(), *after = FCM_NewSession();
+            got.count = 0;
+            if (blocks) {
+                FCM_SetBlockCallback( before, log_block, &got );
+                FCM_SetBlockCallback( after, log_block, &got );
+            }
+            run_lines( before, lines, 0, at, cookies, &got );
+            size_t size = FCM_SaveSession( before, snapshot, sizeof(snapshot) );
+            int result = FCM_RestoreSession( after, snapshot, size );
+            int differ = (FCM_SaveSession( after, again, sizeof(again) ) != size || memcmp(again, snapshot, size) != 0);
+            run_lines( after, lines, at, count, cookies, &got );
+            FCM_FlushBlock( after );
+
+            differ |= (result != FCM_SNAPSHOT_OK || got.count != want.count);
+            for (int i = 0; i < got.count && !differ; i++)
+                differ = (got.events[i] != want.events[i]);
+            for (int i = at; i < count && !differ; i++)
+                if (cookies[i] != expected[i]) {
+                    printf("line %d: %d, not %d: %s\n", i + 1, cookies[i], expected[i], lines[i]);
+                    differ = 1;
+                }
+            if (differ) {
+                printf("%s snapshot at line %d (%zu bytes, restore %d) went astray\n",
+                       blocks ? "block" : "plain", at + 1, size, result);
+                failures++;
+            }
+            FCM_FreeSession( before );
+            FCM_FreeSession( after );
+        }
+
+        // A session reset, every other time in the middle of a block, must carry on like a new session.
+        for (int n = 0; blocks && n < snapshots; n++) {
+            unsigned char snapshot[FCM_SESSION_SNAPSHOT], fresh[FCM_SESSION_SNAPSHOT];
+            int at = rand() % (count + 1);
+            FCMSession *s = FCM_NewSession(), *t = FCM_NewSession();
+            FCM_SetBlockCallback( s, log_block, &got );
+            FCM_SetBlockCallback( t, log_block, &got );
+            run_lines( s, lines, 0, at, cookies, &got );
+            for ( ; n % 2 && at < count && s->block->kind == FCM_BLOCK_None; at++)
+                run_lines( s, lines, at, at + 1, cookies, &got );
+
+            FCM_ResetSession( s );
+            FCM_ResetSession( t );
+            size_t size = FCM_SaveSession( s, snapshot, sizeof(snapshot) );
+            int differ = (size != FCM_SaveSession( t, fresh, sizeof(fresh) ) || memcmp(snapshot, fresh, size) != 0
+                          || s->nameAt != t->nameAt || s->shadowTicks != t->shadowTicks || s->blockUsed != t->blockUsed);
+            got.count = 0;
+            run_lines( s, lines, 0, count, cookies, &got );
+            FCM_FlushBlock( s );
+
+            differ |= (got.count != want.count);
+            for (int i = 0; i < got.count && !differ; i++)
+                differ = (got.events[i] != want.events[i]);
+            for (int i = 0; i < count && !differ; i++)
+                differ = (cookies[i] != expected[i]);
+            if (differ) {
+                printf("session reset at line %d went astray\n", at + 1);
+                failures++;
+            }
+            FCM_FreeSession( s );
+            FCM_FreeSession( t );
+        }
+    }
+    printf("%d lines, %d snapshots and %d resets, %d failed\n", count, 2 * snapshots, snapshots, failures);
+
+    for (int i = 0; i < count; i++)
+        free(lines[i]);
+    ReleaseFIBSCookieMonster();
+    return failures != 0;
+}
+#endif
@@ -36,14 +36,150 @@
  * ---------------------------------------------------------------------------
  */
 
+#ifndef FIBSCOOKIEMONSTER_H
+#define FIBSCOOKIEMONSTER_H
+
 #include "clip.h"
 
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
 // The public functions exported by FIBSCookieMonster
 
 int  FIBSCookie(const char * message);
 void ResetFIBSCookieMonster();
 void ReleaseFIBSCookieMonster();
 
+// Sessions, for clients with more than one connection to FIBS.
+// FIBSCookie() above uses a built-in default session.
+
+typedef struct FCMSession FCMSession;
+
+FCMSession * FCM_NewSession();
+void FCM_FreeSession(FCMSession * session);
+void FCM_ResetSession(FCMSession * session);
+int  FCM_SessionCookie(FCMSession * session, const char * message);
+
+// Where the rule that matched the last message says the player name starts,
+// or -1. See also FCM_PlayerAt() in FIBSNames.h.
+int  FCM_SessionNameAt(const FCMSession * session);
+
+// Called with every cookie of the session, e.g. to keep a FIBSGameState up to date.
+typedef void (*FCMObserver)(int cookie, const char * message, void * context);
+void FCM_SetObserver(FCMSession * session, FCMObserver observer, void * context);
+
+// Classifies messages[i] for sessions[i], storing the cookie in cookies[i].
+// Lines of the same session are classified in array order.
+void FCM_SessionCookies(FCMSession * const sessions[], const char * const messages[], int cookies[], int count);
+
+// Multi-line responses, collected in one record per block. While a session
+// collects blocks, the lines of a block are classified as FIBS_Block, and the
+// record is passed to the callback when the block ends.
+
+typedef enum
+{
+	FCM_BLOCK_None,
+	FCM_BLOCK_Settings,				// FIBS_Settings, then boardstyle: ... timezone:
+	FCM_BLOCK_Toggles,				// FIBS_SettingsHeader, then allowpip YES ... wrap NO
+	FCM_BLOCK_PlayerInfo,			// FIBS_PlayerInfoStart, then last login, rating, email...
+	FCM_BLOCK_ShowMoves,			// FIBS_ShowMovesStart, then the X: and O: lines
+	FCM_BLOCK_RatingCalc,			// FIBS_RatingCalcStart, then FIBS_RatingCalcInfo lines
+	FCM_BLOCK_SavedMatches,			// header, then one line per saved match
+	FCM_BLOCK_Kinds
+} FCM_BlockKind;
+
+#define FCM_BLOCK_LINES 64
+
+typedef struct FCMBlock
+{
+	int          kind;
+	int          more;						// the block continues in the next record
+	int          lines;
+	int          cookies[FCM_BLOCK_LINES];	// cookie and text of each line, header first
+	const char * text[FCM_BLOCK_LINES];
+	char         buffer[4096];
+} FCMBlock;
+
+typedef void (*FCMBlockCallback)(const FCMBlock * block, void * context);
+
+int  FCM_SetBlockCallback(FCMSession * session, FCMBlockCallback callback, void * context);
+void FCM_FlushBlock(FCMSession * session);
+
+// Snapshots of a session, to move a connection to another thread or process,
+// or to restart a worker, without replaying the session. A snapshot takes at
+// most FCM_SESSION_SNAPSHOT bytes, much less unless a block is being collected.
+
+#define FCM_SESSION_SNAPSHOT (16 + 4 * FCM_BLOCK_LINES + sizeof(((FCMBlock *)0)->buffer))
+
+// Returned by FCM_RestoreSession()
+enum {
+	FCM_SNAPSHOT_OK,
+	FCM_SNAPSHOT_VERSION,		// not a snapshot, or of another version
+	FCM_SNAPSHOT_DAMAGED,
+	FCM_SNAPSHOT_NO_BLOCKS		// the snapshot has a block, set a block callback first
+};
+
+size_t FCM_SaveSession(const FCMSession * session, void * buffer, size_t size);
+int  FCM_RestoreSession(FCMSession * session, const void * buffer, size_t size);
+
+// Rules files, to change the rules without restarting. The built-in rules
+// are used until a file is loaded. See the README for the format.
+
+typedef struct FCMRulesInfo
+{
+	unsigned version;				// counts up from 1 with every set of rules
+	int      rules;
+	time_t   loaded;				// when the rules were made
+	long     microseconds;			// time it took to compile them
+} FCMRulesInfo;
+
+unsigned FCM_LoadRules(const char * path);
+int  FCM_SaveRules(const char * path);
+int  FCM_RulesInfo(FCMRulesInfo * info);
+
+// Memory used by the rules, shared by all sessions, and by one session.
+// The regex figure is an estimate: with glibc it is the growth of the heap
+// seen by mallinfo2() while each regex is compiled, which misses other arenas
+// and includes whatever other threads allocate meanwhile. Elsewhere a regex
+// counts as sizeof(regex_t). The other figures are exact.
+
+typedef struct FCMMemory
+{
+	size_t rules;					// rules, candidate lists and rules file
+	size_t regex;					// compiled regexes, estimated
+	size_t code;					// code of the compact rules
+	int    compactRules;			// rules that need no regex
+} FCMMemory;
+
+int  FCM_RulesMemory(FCMMemory * memory);
+size_t FCM_SessionMemory(const FCMSession * session);
+void FCM_SetCompactRules(int compact);
+
+const char * FCM_CookieName(int cookie);
+int  FCM_CookieByName(const char * name, size_t length);
+
+// Matching engines, all giving the same cookies, some faster. "regexec" is
+// the reference and the default; "prefilter" and "candidates" are faster and
+// must be selected. A shadow engine checks the one selected on a sample of
+// the lines, and the fuzzer checks it on random lines made from the rules.
+
+#define FCM_SHADOW_RECORDS 32
+
+typedef struct FCMDisagreement
+{
+	int  cookie;					// from the selected engine
+	int  shadowCookie;
+	char text[256];					// the message, cut short if needed
+} FCMDisagreement;
+
+int  FCM_SelectEngine(const char * name);
+const char * FCM_EngineName();
+const char * FCM_EngineNameAt(int index);	// NULL past the last engine
+int  FCM_SetShadowEngine(const char * name, unsigned every);
+int  FCM_ShadowReport(unsigned long * sampled, unsigned long * disagreements, FCMDisagreement * records, int max);
+int  FCM_FuzzEngine(const char * name, int linesPerRule, unsigned seed, FILE * report);
+
 
 typedef enum
 {
@@ -256,5 +392,8 @@ typedef enum
 	FIBS_TelnetFalse,
 	FIBS_WrapTrue,
 	FIBS_WrapFalse,
+	FIBS_Block,						// line of a block, see FCM_SetBlockCallback()
 	FIBS_LastMessage	// NO MORE MESSAGES HERE!
 } FIBS_Cookies;
+
+#endif
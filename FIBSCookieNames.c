@@ -0,0 +1,262 @@
+/*
+ * ---  FIBSCookieNames.c ----------------------------------------------------
+ *
+ * The name of every cookie, as spelled in FIBSCookieMonster.h and clip.h.
+ * Used to read and write rules files, and to print cookies in logs.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#include "FIBSCookieMonster.h"
+
+#include <string.h>
+
+#define NAME(cookie) [cookie] = #cookie
+
+static const char * const CookieNames[FIBS_LastMessage] = {
+    NAME(CLIP_WELCOME),
+    NAME(CLIP_OWN_INFO),
+    NAME(CLIP_MOTD_BEGIN),
+    NAME(CLIP_MOTD_END),
+    NAME(CLIP_WHO_INFO),
+    NAME(CLIP_WHO_END),
+    NAME(CLIP_LOGIN),
+    NAME(CLIP_LOGOUT),
+    NAME(CLIP_MESSAGE),
+    NAME(CLIP_MESSAGE_DELIVERED),
+    NAME(CLIP_MESSAGE_SAVED),
+    NAME(CLIP_SAYS),
+    NAME(CLIP_SHOUTS),
+    NAME(CLIP_WHISPERS),
+    NAME(CLIP_KIBITZES),
+    NAME(CLIP_YOU_SAY),
+    NAME(CLIP_YOU_SHOUT),
+    NAME(CLIP_YOU_WHISPER),
+    NAME(CLIP_YOU_KIBITZ),
+    NAME(CLIP_ALERT),
+    NAME(FIBS_PreLogin),
+    NAME(FIBS_LoginPrompt),
+    NAME(FIBS_FailedLogin),
+    NAME(FIBS_MOTD),
+    NAME(FIBS_Goodbye),
+    NAME(FIBS_PostGoodbye),
+    NAME(FIBS_Unknown),
+    NAME(FIBS_Empty),
+    NAME(FIBS_Junk),
+    NAME(FIBS_ClearScreen),
+    NAME(FIBS_BAD_AcceptDouble),
+    NAME(FIBS_BAD_Board),
+    NAME(FIBS_Average),
+    NAME(FIBS_DiceTest),
+    NAME(FIBS_Stat),
+    NAME(FIBS_Why),
+    NAME(FIBS_NoInfo),
+    NAME(FIBS_LastLogout),
+    NAME(FIBS_RatingCalcStart),
+    NAME(FIBS_RatingCalcInfo),
+    NAME(FIBS_SettingsHeader),
+    NAME(FIBS_PlayerListHeader),
+    NAME(FIBS_AwayListHeader),
+    NAME(FIBS_RatingExperience),
+    NAME(FIBS_NotLoggedIn),
+    NAME(FIBS_StillLoggedIn),
+    NAME(FIBS_NoOneIsAway),
+    NAME(FIBS_RatingsHeader),
+    NAME(FIBS_IsPlayingWith),
+    NAME(FIBS_Timeout),
+    NAME(FIBS_UnknownCommand),
+    NAME(FIBS_Username),
+    NAME(FIBS_LastLogin),
+    NAME(FIBS_YourLastLogin),
+    NAME(FIBS_Registered),
+    NAME(FIBS_ONEUSERNAME),
+    NAME(FIBS_EnterUsername),
+    NAME(FIBS_EnterPassword),
+    NAME(FIBS_TypeInNo),
+    NAME(FIBS_SavedScoreHeader),
+    NAME(FIBS_NoSavedGames),
+    NAME(FIBS_UsersHeardYou),
+    NAME(FIBS_MessagesForYou),
+    NAME(FIBS_IsAway),
+    NAME(FIBS_OpponentLogsOut),
+    NAME(FIBS_Waves),
+    NAME(FIBS_WavesAgain),
+    NAME(FIBS_YouGag),
+    NAME(FIBS_YouUngag),
+    NAME(FIBS_YouBlind),
+    NAME(FIBS_YouUnblind),
+    NAME(FIBS_WatchResign),
+    NAME(FIBS_UseToggleReady),
+    NAME(FIBS_WARNINGSavedMatch),
+    NAME(FIBS_NoSavedMatch),
+    NAME(FIBS_AlreadyPlaying),
+    NAME(FIBS_DidntInvite),
+    NAME(FIBS_WatchingHeader),
+    NAME(FIBS_NotWatching),
+    NAME(FIBS_NotWatchingPlaying),
+    NAME(FIBS_NotPlaying),
+    NAME(FIBS_PlayerNotPlaying),
+    NAME(FIBS_NoUser),
+    NAME(FIBS_CantInviteSelf),
+    NAME(FIBS_CantWatch),
+    NAME(FIBS_CantTalk),
+    NAME(FIBS_CantBlindYourself),
+    NAME(FIBS_CantGagYourself),
+    NAME(FIBS_WontListen),
+    NAME(FIBS_TypeBack),
+    NAME(FIBS_NoOne),
+    NAME(FIBS_BadMove),
+    NAME(FIBS_MustMove),
+    NAME(FIBS_MustComeIn),
+    NAME(FIBS_CantShout),
+    NAME(FIBS_DontKnowUser),
+    NAME(FIBS_MessageUsage),
+    NAME(FIBS_Done),
+    NAME(FIBS_SavedMatchesHeader),
+    NAME(FIBS_NotYourTurnToRoll),
+    NAME(FIBS_NotYourTurnToMove),
+    NAME(FIBS_YourTurnToMove),
+    NAME(FIBS_Ratings),
+    NAME(FIBS_PlayerInfoStart),
+    NAME(FIBS_EmailAddress),
+    NAME(FIBS_NoEmail),
+    NAME(FIBS_ListOfGames),
+    NAME(FIBS_SavedMatch),
+    NAME(FIBS_SavedMatchPlaying),
+    NAME(FIBS_SavedMatchReady),
+    NAME(FIBS_YouAreWatching),
+    NAME(FIBS_YouStopWatching),
+    NAME(FIBS_PlayerStartsWatching),
+    NAME(FIBS_PlayerStopsWatching),
+    NAME(FIBS_PlayerIsWatching),
+    NAME(FIBS_ReportUnlimitedMatch),
+    NAME(FIBS_ReportLimitedMatch),
+    NAME(FIBS_RollOrDouble),
+    NAME(FIBS_YouWinMatch),
+    NAME(FIBS_PlayerWinsMatch),
+    NAME(FIBS_YouReject),
+    NAME(FIBS_YouResign),
+    NAME(FIBS_ResumeMatchRequest),
+    NAME(FIBS_ResumeMatchAck0),
+    NAME(FIBS_ResumeMatchAck5),
+    NAME(FIBS_NewMatchRequest),
+    NAME(FIBS_UnlimitedInvite),
+    NAME(FIBS_YouInvited),
+    NAME(FIBS_NewMatchAck9),
+    NAME(FIBS_NewMatchAck10),
+    NAME(FIBS_NewMatchAck2),
+    NAME(FIBS_YouTerminated),
+    NAME(FIBS_OpponentLeftGame),
+    NAME(FIBS_PlayerLeftGame),
+    NAME(FIBS_PlayerRefusingGames),
+    NAME(FIBS_TypeJoin),
+    NAME(FIBS_ShowMovesStart),
+    NAME(FIBS_ShowMovesWins),
+    NAME(FIBS_ShowMovesRoll),
+    NAME(FIBS_ShowMovesDoubles),
+    NAME(FIBS_ShowMovesAccepts),
+    NAME(FIBS_ShowMovesRejects),
+    NAME(FIBS_ShowMovesOther),
+    NAME(FIBS_Board),
+    NAME(FIBS_YouRoll),
+    NAME(FIBS_PlayerRolls),
+    NAME(FIBS_PlayerMoves),
+    NAME(FIBS_Doubles),
+    NAME(FIBS_AcceptRejectDouble),
+    NAME(FIBS_StartingNewGame),
+    NAME(FIBS_PlayerAcceptsDouble),
+    NAME(FIBS_YouAcceptDouble),
+    NAME(FIBS_Settings),
+    NAME(FIBS_Turn),
+    NAME(FIBS_FirstRoll),
+    NAME(FIBS_DoublingCubeNow),
+    NAME(FIBS_CantMove),
+    NAME(FIBS_CantMoveFirstMove),
+    NAME(FIBS_ResignRefused),
+    NAME(FIBS_YouWinGame),
+    NAME(FIBS_OnlyPossibleMove),
+    NAME(FIBS_AcceptWins),
+    NAME(FIBS_ResignWins),
+    NAME(FIBS_ResignYouWin),
+    NAME(FIBS_WatchGameWins),
+    NAME(FIBS_ScoreUpdate),
+    NAME(FIBS_MatchStart),
+    NAME(FIBS_YouAcceptAndWin),
+    NAME(FIBS_OnlyMove),
+    NAME(FIBS_BearingOff),
+    NAME(FIBS_PleaseMove),
+    NAME(FIBS_MakesFirstMove),
+    NAME(FIBS_YouDouble),
+    NAME(FIBS_MatchLength),
+    NAME(FIBS_PlayerWantsToResign),
+    NAME(FIBS_PlayerWinsGame),
+    NAME(FIBS_JoinNextGame),
+    NAME(FIBS_ResumingUnlimitedMatch),
+    NAME(FIBS_ResumingLimitedMatch),
+    NAME(FIBS_PlayersStartingMatch),
+    NAME(FIBS_PlayersStartingUnlimitedMatch),
+    NAME(FIBS_MatchResult),
+    NAME(FIBS_YouGiveUp),
+    NAME(FIBS_PlayerIsWaitingForYou),
+    NAME(FIBS_Boardstyle),
+    NAME(FIBS_Linelength),
+    NAME(FIBS_Pagelength),
+    NAME(FIBS_Redoubles),
+    NAME(FIBS_Sortwho),
+    NAME(FIBS_Timezone),
+    NAME(FIBS_RedoublesSetTo),
+    NAME(FIBS_AllowpipTrue),
+    NAME(FIBS_AllowpipFalse),
+    NAME(FIBS_AutoboardTrue),
+    NAME(FIBS_AutoboardFalse),
+    NAME(FIBS_AutodoubleTrue),
+    NAME(FIBS_AutodoubleFalse),
+    NAME(FIBS_AutomoveTrue),
+    NAME(FIBS_AutomoveFalse),
+    NAME(FIBS_BellTrue),
+    NAME(FIBS_BellFalse),
+    NAME(FIBS_CrawfordTrue),
+    NAME(FIBS_CrawfordFalse),
+    NAME(FIBS_DoubleTrue),
+    NAME(FIBS_DoubleFalse),
+    NAME(FIBS_MoreboardsTrue),
+    NAME(FIBS_MoreboardsFalse),
+    NAME(FIBS_MovesTrue),
+    NAME(FIBS_MovesFalse),
+    NAME(FIBS_GreedyTrue),
+    NAME(FIBS_GreedyFalse),
+    NAME(FIBS_NotifyTrue),
+    NAME(FIBS_NotifyFalse),
+    NAME(FIBS_RatingsTrue),
+    NAME(FIBS_RatingsFalse),
+    NAME(FIBS_ReadyTrue),
+    NAME(FIBS_ReadyFalse),
+    NAME(FIBS_ReportTrue),
+    NAME(FIBS_ReportFalse),
+    NAME(FIBS_SilentTrue),
+    NAME(FIBS_SilentFalse),
+    NAME(FIBS_TelnetTrue),
+    NAME(FIBS_TelnetFalse),
+    NAME(FIBS_WrapTrue),
+    NAME(FIBS_WrapFalse),
+    NAME(FIBS_Block),
+};
+
+// Returns the name of a cookie, e.g. "FIBS_Board", or NULL if there is no such cookie.
+const char * FCM_CookieName(int cookie)
+{
+    if (cookie < 0 || cookie >= FIBS_LastMessage)
+        return NULL;
+    return CookieNames[cookie];
+}
+
+// Returns the cookie called name, or FIBS_BAD_COOKIE. The name is the first
+// length characters, so it needn't be 0 terminated.
+int FCM_CookieByName(const char * name, size_t length)
+{
+    for (int cookie = 0; cookie < FIBS_LastMessage; cookie++)
+        if (CookieNames[cookie] && strncmp(CookieNames[cookie], name, length) == 0
+                                && CookieNames[cookie][length] == '\0')
+            return cookie;
+    return FIBS_BAD_COOKIE;
+}
@@ -0,0 +1,417 @@
+/*
+ * ---  FIBSGameState.c ------------------------------------------------------
+ *
+ * Each message is applied as a small change to the state. Only a FIBS_Board
+ * message is parsed in full, and it replaces whatever we had.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#include "FIBSGameState.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_FIBSGAMESTATE 0            // see main(), below
+
+#define BOARD_FIELDS 53     // "board" and the 52 fields after it
+
+static int is_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '<' || c == '>';
+}
+
+static size_t name_length(const char * p)
+{
+    size_t n = 0;
+    while (is_name_char(p[n]))
+        n++;
+    return n;
+}
+
+// 1 if the name at p is the opponent, else 0 ("You", or the player watched)
+static int side_of(const FIBSGameState * g, const char * p)
+{
+    size_t n = name_length(p);
+    return (n > 0 && strncmp(p, g->name[1], n) == 0 && g->name[1][n] == '\0') ? 1 : 0;
+}
+
+static int sign_of(const FIBSGameState * g, int side)
+{
+    return side == 0 ? g->colour : -g->colour;
+}
+
+static int home_of(const FIBSGameState * g, int side)
+{
+    return side == 0 ? g->home : 25 - g->home;
+}
+
+// Reads up to n numbers from p, skipping anything else. Returns how many were found.
+static int numbers(const char * p, int out[], int n)
+{
+    int found = 0;
+    while (*p && found < n) {
+        if (*p >= '0' && *p <= '9') {
+            char * end;
+            out[found++] = (int)strtol(p, &end, 10);
+            p = end;
+        } else {
+            p++;
+        }
+    }
+    return found;
+}
+
+static void new_game(FIBSGameState * g)
+{
+    memset(g->board, 0, sizeof(g->board));
+    memset(g->dice, 0, sizeof(g->dice));
+    memset(g->off, 0, sizeof(g->off));
+    memset(g->onBar, 0, sizeof(g->onBar));
+    g->turn = 0;
+    g->cube = 1;
+    g->mayDouble[0] = g->mayDouble[1] = 1;
+    g->doubled = 0;
+
+    // The starting position, counted from each player's home
+    static const int points[4] = { 6, 8, 13, 24 }, checkers[4] = { 5, 3, 5, 2 };
+    for (int side = 0; side < 2 && g->synced; side++)
+        for (int i = 0; i < 4; i++) {
+            int point = home_of(g, side) == 0 ? points[i] : 25 - points[i];
+            g->board[point] = (signed char)(checkers[i] * sign_of(g, side));
+        }
+}
+
+static void game_over(FIBSGameState * g, int winner, int points)
+{
+    g->score[winner] += points;
+    g->turn = 0;
+    g->doubled = 0;
+    memset(g->dice, 0, sizeof(g->dice));
+}
+
+// board:You:jfk:5:0:0:<26 board fields>:turn:dice:cube:... see the CLIP documentation
+static int parse_board(FIBSGameState * g, const char * message)
+{
+    const char * field[BOARD_FIELDS];
+    int n = 0;
+    for (const char * p = message; n < BOARD_FIELDS; p++) {
+        field[n++] = p;
+        if ((p = strchr(p, ':')) == NULL)
+            break;
+    }
+    if (n < BOARD_FIELDS)
+        return 0;
+
+#define FIELD(i) ((int)strtol(field[i], NULL, 10))
+    for (int side = 0; side < 2; side++) {
+        size_t length = strcspn(field[1 + side], ":");
+        if (length >= sizeof(g->name[side]))
+            length = sizeof(g->name[side]) - 1;
+        memcpy(g->name[side], field[1 + side], length);
+        g->name[side][length] = '\0';
+    }
+    g->matchLength = (short)FIELD(3);
+    g->score[0] = (short)FIELD(4);
+    g->score[1] = (short)FIELD(5);
+    for (int i = 0; i < 26; i++)
+        g->board[i] = (signed char)FIELD(6 + i);
+    g->turn = (signed char)FIELD(32);
+    g->dice[0][0] = (signed char)FIELD(33);
+    g->dice[0][1] = (signed char)FIELD(34);
+    g->dice[1][0] = (signed char)FIELD(35);
+    g->dice[1][1] = (signed char)FIELD(36);
+    g->cube = (short)FIELD(37);
+    g->mayDouble[0] = (signed char)FIELD(38);
+    g->mayDouble[1] = (signed char)FIELD(39);
+    g->doubled = (signed char)FIELD(40);
+    g->colour = (signed char)FIELD(41);
+    g->direction = (signed char)FIELD(42);
+    g->home = (signed char)FIELD(43);
+    g->off[0] = (signed char)FIELD(45);
+    g->off[1] = (signed char)FIELD(46);
+    g->onBar[0] = (signed char)FIELD(47);
+    g->onBar[1] = (signed char)FIELD(48);
+#undef FIELD
+    g->synced = 1;
+    return 1;
+}
+
+// jfk moves 1-7 12-16 / fergy moves bar-22 6-off
+static int apply_moves(FIBSGameState * g, const char * message)
+{
+    int side = side_of(g, message);
+    int sign = sign_of(g, side), other = 1 - side;
+    int home = home_of(g, side), bar = 25 - home;
+    const char * p = strstr(message, " moves ");
+    if (p == NULL || !g->synced)
+        return 0;
+
+    for (p += 7; *p; ) {
+        int from, to;
+        char * end;
+        while (*p == ' ')
+            p++;
+        if (strncmp(p, "bar", 3) == 0) {
+            from = bar;
+            p += 3;
+        } else if (*p >= '0' && *p <= '9') {
+            from = (int)strtol(p, &end, 10);
+            p = end;
+        } else {
+            break;
+        }
+        if (*p++ != '-')
+            break;
+        if (strncmp(p, "off", 3) == 0) {
+            to = home;
+            p += 3;
+        } else if (*p >= '0' && *p <= '9') {
+            to = (int)strtol(p, &end, 10);
+            p = end;
+        } else {
+            break;
+        }
+        if (from < 0 || from > 25 || to < 0 || to > 25)
+            break;
+
+        g->board[from] -= sign;
+        if (from == bar)
+            g->onBar[side]--;
+        if (to == home) {
+            g->off[side]++;
+            continue;
+        }
+        if (g->board[to] == -sign) {            // hit, the opponent's bar is our home
+            g->board[to] = 0;
+            g->board[home] -= sign;
+            g->onBar[other]++;
+        }
+        g->board[to] += sign;
+    }
+    memset(g->dice[side], 0, sizeof(g->dice[side]));
+    g->turn = (signed char)-sign;
+    return 1;
+}
+
+static int apply_roll(FIBSGameState * g, int side, const char * message)
+{
+    int dice[2];
+    if (numbers(message, dice, 2) != 2)
+        return 0;
+    g->dice[side][0] = (signed char)dice[0];
+    g->dice[side][1] = (signed char)dice[1];
+    g->turn = (signed char)sign_of(g, side);
+    return 1;
+}
+
+// You rolled 3, jfk rolled 1
+static int apply_first_roll(FIBSGameState * g, const char * message)
+{
+    int dice[2];
+    const char * second = strstr(message, ", ");
+    if (second == NULL || numbers(message, dice, 2) != 2 || dice[0] == dice[1])
+        return 0;
+    int side = side_of(g, dice[0] > dice[1] ? message : second + 2);
+    g->dice[side][0] = (signed char)dice[0];
+    g->dice[side][1] = (signed char)dice[1];
+    g->turn = (signed char)sign_of(g, side);
+    return 1;
+}
+
+// You accept the double. The cube shows 2. / jfk accepts the double.
+static int apply_accept(FIBSGameState * g, int side, const char * message)
+{
+    int cube;
+    const char * shows = strstr(message, "cube shows ");
+    g->cube = (short)(shows && numbers(shows, &cube, 1) == 1 ? cube : g->cube * 2);
+    g->mayDouble[side] = 1;
+    g->mayDouble[1 - side] = 0;
+    g->doubled = 0;
+    return 1;
+}
+
+// score in 5 point match: fergy-0 jfk-0
+static int apply_score(FIBSGameState * g, const char * message)
+{
+    const char * p = strchr(message, ':');
+    if (p == NULL)
+        return 0;
+    while (*p) {
+        while (*p && !is_name_char(*p))
+            p++;
+        size_t n = name_length(p);
+        if (n == 0 || p[n] != '-')
+            break;
+        g->score[side_of(g, p)] = (short)strtol(p + n + 1, NULL, 10);
+        p += n + 1;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    return 1;
+}
+
+// The winner is the name just before " win", e.g. "You give up. jfk wins 1 point."
+static int apply_win(FIBSGameState * g, const char * message)
+{
+    int points;
+    const char * win = strstr(message, " win");
+    if (win == NULL || numbers(win, &points, 1) != 1)
+        return 0;
+    const char * name = win;
+    while (name > message && is_name_char(name[-1]))
+        name--;
+    game_over(g, side_of(g, name), points);
+    return 1;
+}
+
+void FCM_ResetGameState(FIBSGameState * g)
+{
+    memset(g, 0, sizeof(FIBSGameState));
+    g->cube = 1;
+    g->mayDouble[0] = g->mayDouble[1] = 1;
+}
+
+int FCM_GameStateUpdate(FIBSGameState * g, int cookie, const char * message)
+{
+    int values[3];
+
+    switch (cookie) {
+    case FIBS_Board:
+        return parse_board(g, message);
+    case FIBS_PlayerMoves:
+        return apply_moves(g, message);
+    case FIBS_YouRoll:
+        return apply_roll(g, 0, message);
+    case FIBS_PlayerRolls:
+        return apply_roll(g, side_of(g, message), message);
+    case FIBS_FirstRoll:
+        return apply_first_roll(g, message);
+
+    case FIBS_Doubles:
+    case FIBS_AcceptRejectDouble:
+        g->doubled = side_of(g, message) ? -1 : 1;
+        return 1;
+    case FIBS_YouDouble:
+        g->doubled = 1;
+        return 1;
+    case FIBS_YouAcceptDouble:
+        return apply_accept(g, 0, message);
+    case FIBS_PlayerAcceptsDouble:
+        return apply_accept(g, side_of(g, message), message);
+    case FIBS_DoublingCubeNow:
+        if (numbers(message, values, 1) != 1)
+            return 0;
+        g->cube = (short)values[0];
+        return 1;
+
+    case FIBS_ScoreUpdate:
+        return apply_score(g, message);
+    case FIBS_MatchStart:                       // Score is 0-0 in a 5 point match.
+        if (numbers(message, values, 3) != 3)
+            return 0;
+        g->score[0] = (short)values[0];
+        g->score[1] = (short)values[1];
+        g->matchLength = (short)values[2];
+        return 1;
+    case FIBS_StartingNewGame:
+        new_game(g);
+        return 1;
+
+    case FIBS_YouWinGame:
+    case FIBS_PlayerWinsGame:
+    case FIBS_WatchGameWins:
+    case FIBS_ResignWins:
+    case FIBS_ResignYouWin:
+    case FIBS_YouGiveUp:
+        return apply_win(g, message);
+    case FIBS_YouAcceptAndWin:                  // You accept and win 2 points.
+    case FIBS_AcceptWins:                       // jfk accepts and wins 2 points.
+        if (numbers(message, values, 1) != 1)
+            return 0;
+        game_over(g, cookie == FIBS_YouAcceptAndWin ? 0 : side_of(g, message), values[0]);
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+static void game_observer(int cookie, const char * message, void * context)
+{
+    FCM_GameStateUpdate(context, cookie, message);
+}
+
+void FCM_AttachGameState(FCMSession * session, FIBSGameState * game)
+{
+    FCM_SetObserver(session, game ? game_observer : NULL, game);
+}
+
+#if TEST_FIBSGAMESTATE
+// Runs a short game through the tracker and checks the state after each
+// message. Prints the checks that fail, and exits with 1 if any did.
+//
+// % cc -std=c99 -o ThisTestApp FIBSGameState.c FIBSCookieMonster.c FIBSCookieNames.c FIBSCompactRegex.c -lpthread
+// % ThisTestApp
+
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(step, condition) \
+    if (!(condition)) { printf("%s: %s failed\n", step, #condition); failures++; }
+
+int main()
+{
+    FIBSGameState state, *g = &state;
+    FCM_ResetGameState(g);
+
+    const char * board = "board:You:jfk:5:0:0:0:-2:0:0:0:0:5:0:3:0:0:0:-5:5:0:0:0:-3:0:-5:0:0:0:0:2:0"
+                         ":1:3:1:0:0:1:1:1:0:1:-1:0:25:0:0:0:0:2:0:0:0";
+    CHECK("board", FCM_GameStateUpdate(g, FIBS_Board, board) == 1);
+    CHECK("board", g->synced && strcmp(g->name[1], "jfk") == 0 && g->matchLength == 5);
+    CHECK("board", g->board[6] == 5 && g->board[1] == -2 && g->turn == 1 && g->dice[0][0] == 3 && g->colour == 1);
+
+    FCM_GameStateUpdate(g, FIBS_PlayerMoves, "jfk moves 1-4 12-14");
+    CHECK("moves", g->board[1] == -1 && g->board[4] == -1 && g->board[12] == -4 && g->board[14] == -1);
+    CHECK("moves", g->turn == 1);
+
+    // A watched player is side 0 too; this one hits the blot on 4.
+    FCM_GameStateUpdate(g, FIBS_PlayerMoves, "pwatched moves 6-4");
+    CHECK("hit", g->board[6] == 4 && g->board[4] == 1 && g->board[0] == -1 && g->onBar[1] == 1);
+
+    FCM_GameStateUpdate(g, FIBS_PlayerRolls, "jfk rolls 5 and 2");
+    CHECK("roll", g->dice[1][0] == 5 && g->dice[1][1] == 2 && g->turn == -1);
+
+    FCM_GameStateUpdate(g, FIBS_Doubles, "jfk doubles. Type 'accept' or 'reject'.");
+    CHECK("double", g->doubled == -1);
+    FCM_GameStateUpdate(g, FIBS_YouAcceptDouble, "You accept the double. The cube shows 2.");
+    CHECK("accept", g->cube == 2 && g->doubled == 0 && g->mayDouble[0] == 1 && g->mayDouble[1] == 0);
+
+    FCM_GameStateUpdate(g, FIBS_YouAcceptAndWin, "You accept and win 2 points.");
+    CHECK("you accept and win", g->score[0] == 2 && g->score[1] == 0 && g->turn == 0);
+
+    FCM_GameStateUpdate(g, FIBS_StartingNewGame, "Starting a new game with jfk.");
+    CHECK("new game", g->board[6] == 5 && g->board[4] == 0 && g->board[19] == -5 && g->cube == 1);
+
+    FCM_GameStateUpdate(g, FIBS_AcceptWins, "jfk accepts and wins 4 points.");
+    CHECK("accepts and wins", g->score[0] == 2 && g->score[1] == 4);
+
+    FCM_GameStateUpdate(g, FIBS_ResignYouWin, "jfk gives up. You win 1 point.");
+    CHECK("resign", g->score[0] == 3 && g->score[1] == 4);
+
+    FCM_GameStateUpdate(g, FIBS_YouGiveUp, "You give up. jfk wins 1 point.");
+    CHECK("give up", g->score[0] == 3 && g->score[1] == 5);
+
+    FCM_GameStateUpdate(g, FIBS_ScoreUpdate, "score in 5 point match: You-1 jfk-2");
+    CHECK("score", g->score[0] == 1 && g->score[1] == 2);
+
+    FCM_GameStateUpdate(g, FIBS_PlayerWinsGame, "jfk wins the game and gets 2 points. Sorry.");
+    CHECK("wins game", g->score[0] == 1 && g->score[1] == 4);
+
+    CHECK("ignored", FCM_GameStateUpdate(g, FIBS_Unknown, "whatever") == 0);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures != 0;
+}
+#endif
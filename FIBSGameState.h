@@ -0,0 +1,52 @@
+/*
+ * ---  FIBSGameState.h ------------------------------------------------------
+ *
+ * Optional tracker of the game being played or watched in a session.
+ *
+ * The state is taken from a FIBS_Board message, and then kept up to date
+ * from the rolls, moves, doubles and results FIBS reports, so clients can
+ * read the position at any time without parsing board lines. A new board
+ * line simply replaces the state.
+ *
+ * The board uses the FIBS numbering: board[1..24] are the points, board[0]
+ * and board[25] the bars, and checkers of the player have the sign of colour.
+ * Moves in FIBS messages use the same numbering for both players.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef FIBSGAMESTATE_H
+#define FIBSGAMESTATE_H
+
+#include "FIBSCookieMonster.h"
+
+// Index 0 of the two element arrays is the player, 1 the opponent. The
+// player is "You" while playing, or the player watched.
+typedef struct FIBSGameState
+{
+    char        name[2][24];
+    short       matchLength;
+    short       score[2];
+    signed char board[26];
+    signed char turn;               // colour of the player to move, 0 if no game is going on
+    signed char dice[2][2];         // 0 if not rolled
+    short       cube;
+    signed char mayDouble[2];
+    signed char doubled;            // 1 if the player doubled, -1 if the opponent did, else 0
+    signed char colour;             // 1 if the player is X, -1 if O
+    signed char direction;          // direction the player moves in
+    signed char home;               // index of the player's home, the player's bar is 25 - home
+    signed char off[2];             // checkers borne off
+    signed char onBar[2];
+    signed char synced;             // a board line has been seen
+} FIBSGameState;
+
+void FCM_ResetGameState(FIBSGameState * game);
+
+// Applies a message to the state. Returns 1 if the state changed.
+int  FCM_GameStateUpdate(FIBSGameState * game, int cookie, const char * message);
+
+// Keeps game up to date with every message of session. Uses the session's observer.
+void FCM_AttachGameState(FCMSession * session, FIBSGameState * game);
+
+#endif
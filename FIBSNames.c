@@ -0,0 +1,363 @@
+/*
+ * ---  FIBSNames.c ----------------------------------------------------------
+ *
+ * The names are kept in an open addressing hash table. Each slot holds the
+ * hash of a name in the upper 32 bits and ID + 1 in the lower 32 bits, 0
+ * means empty. The names themselves live in string blocks that never move,
+ * and the ID -> name directory is a fixed array of chunks, so a name never
+ * changes address once it has been added.
+ *
+ * Readers don't lock: they load the current table and its slots with acquire
+ * semantics. Writers are serialized by a mutex, and publish the name before
+ * the slot that refers to it. When the table fills up it is copied to a table
+ * twice the size, and the old one is kept until FCM_ReleaseNames(), because a
+ * reader may still be probing it. The old tables add up to less than the
+ * current one.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#include "FIBSNames.h"
+#include "FIBSCookieMonster.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__)
+#define LOAD_ACQUIRE(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define LOCKED_READS         0
+#else
+// Without atomics, readers take the mutex too.
+#define LOAD_ACQUIRE(p)      (*(p))
+#define STORE_RELEASE(p, v)  (*(p) = (v))
+#define LOCKED_READS         1
+#endif
+
+#define CHUNK_BITS   10
+#define CHUNK_SIZE   (1 << CHUNK_BITS)
+#define MAX_CHUNKS   4096                // room for 4M names
+#define BLOCK_SIZE   65536
+
+typedef struct NameTable {
+    struct NameTable * retired;          // older, smaller tables
+    uint32_t           size;             // power of two
+    uint64_t           slots[];
+} NameTable;
+
+typedef struct NameBlock {
+    struct NameBlock * next;
+    size_t             used;
+    size_t             size;
+    char               text[];
+} NameBlock;
+
+static pthread_mutex_t WriteLock = PTHREAD_MUTEX_INITIALIZER;
+static NameTable *     Table     = NULL;
+static const char **   Chunks[MAX_CHUNKS];
+static int             Count     = 0;
+static NameBlock *     Blocks    = NULL;
+static size_t          Memory    = 0;
+
+static uint32_t hash_name(const char * name, size_t length)
+{
+    uint32_t h = 2166136261u;           // FNV-1a
+    for (size_t i = 0; i < length; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+static int lookup(const NameTable * t, uint32_t h, const char * name, size_t length)
+{
+    if (t == NULL)
+        return FCM_NO_NAME;
+    uint32_t mask = t->size - 1;
+    for (uint32_t i = h & mask; ; i = (i + 1) & mask) {
+        uint64_t slot = LOAD_ACQUIRE(&t->slots[i]);
+        if (slot == 0)
+            return FCM_NO_NAME;
+        if ((uint32_t)(slot >> 32) == h) {
+            int id = (int)(uint32_t)slot - 1;
+            const char * s = Chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+            if (strncmp(s, name, length) == 0 && s[length] == '\0')
+                return id;
+        }
+    }
+}
+
+static void insert_slot(NameTable * t, uint64_t slot)
+{
+    uint32_t mask = t->size - 1;
+    uint32_t i = (uint32_t)(slot >> 32) & mask;
+    while (t->slots[i] != 0)
+        i = (i + 1) & mask;
+    STORE_RELEASE(&t->slots[i], slot);
+}
+
+// Replaces the table by one twice the size. Called with the lock held.
+static int grow_table()
+{
+    uint32_t size = Table ? Table->size * 2 : 1024;
+    NameTable * t = calloc(1, sizeof(NameTable) + size * sizeof(uint64_t));
+    if (t == NULL)
+        return 0;
+    t->size = size;
+    t->retired = Table;
+    if (Table)
+        for (uint32_t i = 0; i < Table->size; i++)
+            if (Table->slots[i])
+                insert_slot(t, Table->slots[i]);
+    Memory += sizeof(NameTable) + size * sizeof(uint64_t);
+    STORE_RELEASE(&Table, t);
+    return 1;
+}
+
+// Copies the name to a string block. Called with the lock held.
+static const char * store_name(const char * name, size_t length)
+{
+    if (Blocks == NULL || Blocks->used + length + 1 > Blocks->size) {
+        size_t size = length + 1 > BLOCK_SIZE ? length + 1 : BLOCK_SIZE;
+        NameBlock * b = malloc(sizeof(NameBlock) + size);
+        if (b == NULL)
+            return NULL;
+        b->next = Blocks;
+        b->used = 0;
+        b->size = size;
+        Blocks = b;
+        Memory += sizeof(NameBlock) + size;
+    }
+    char * s = Blocks->text + Blocks->used;
+    memcpy(s, name, length);
+    s[length] = '\0';
+    Blocks->used += length + 1;
+    return s;
+}
+
+static int add_name(uint32_t h, const char * name, size_t length)
+{
+    int id = lookup(Table, h, name, length);   // someone may have beaten us to it
+    if (id != FCM_NO_NAME)
+        return id;
+
+    id = Count;
+    if (id >= MAX_CHUNKS * CHUNK_SIZE)
+        return FCM_NO_NAME;
+    if (Table == NULL || 2 * (uint32_t)(id + 1) > Table->size)
+        if (!grow_table())
+            return FCM_NO_NAME;
+    if (Chunks[id >> CHUNK_BITS] == NULL) {
+        const char ** chunk = malloc(CHUNK_SIZE * sizeof(const char *));
+        if (chunk == NULL)
+            return FCM_NO_NAME;
+        Memory += CHUNK_SIZE * sizeof(const char *);
+        STORE_RELEASE(&Chunks[id >> CHUNK_BITS], chunk);
+    }
+    const char * s = store_name(name, length);
+    if (s == NULL)
+        return FCM_NO_NAME;
+
+    Chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)] = s;
+    insert_slot(Table, ((uint64_t)h << 32) | (uint32_t)(id + 1));
+    STORE_RELEASE(&Count, id + 1);
+    return id;
+}
+
+int FCM_FindName(const char * name, size_t length)
+{
+    uint32_t h = hash_name(name, length);
+    if (LOCKED_READS) {
+        pthread_mutex_lock(&WriteLock);
+        int id = lookup(Table, h, name, length);
+        pthread_mutex_unlock(&WriteLock);
+        return id;
+    }
+    return lookup(LOAD_ACQUIRE(&Table), h, name, length);
+}
+
+int FCM_InternName(const char * name, size_t length)
+{
+    uint32_t h = hash_name(name, length);
+    if (!LOCKED_READS) {
+        int id = lookup(LOAD_ACQUIRE(&Table), h, name, length);
+        if (id != FCM_NO_NAME)
+            return id;
+    }
+    pthread_mutex_lock(&WriteLock);
+    int id = add_name(h, name, length);
+    pthread_mutex_unlock(&WriteLock);
+    return id;
+}
+
+const char * FCM_NameString(int id)
+{
+    if (id < 0 || id >= LOAD_ACQUIRE(&Count))
+        return NULL;
+    return Chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+}
+
+int FCM_NameCount()
+{
+    return LOAD_ACQUIRE(&Count);
+}
+
+size_t FCM_NameMemory()
+{
+    pthread_mutex_lock(&WriteLock);
+    size_t bytes = Memory;
+    pthread_mutex_unlock(&WriteLock);
+    return bytes;
+}
+
+void FCM_ReleaseNames()
+{
+    pthread_mutex_lock(&WriteLock);
+    for (NameTable * t = Table; (t); ) {
+        NameTable * older = t->retired;
+        free(t);
+        t = older;
+    }
+    Table = NULL;
+    for (NameBlock * b = Blocks; (b); ) {
+        NameBlock * next = b->next;
+        free(b);
+        b = next;
+    }
+    Blocks = NULL;
+    for (int i = 0; i < MAX_CHUNKS; i++) {
+        free(Chunks[i]);
+        Chunks[i] = NULL;
+    }
+    Count = 0;
+    Memory = 0;
+    pthread_mutex_unlock(&WriteLock);
+}
+
+//--- Player names in messages -----------------------------------------------
+
+// Returns the text in front of the player name for messages that have one,
+// or NULL. CLIP messages are handled by FCM_MessagePlayer().
+static const char * name_prefix(int cookie)
+{
+    switch (cookie) {
+    case FIBS_YouAreWatching:          return "You're now watching ";
+    case FIBS_StartingNewGame:         return "Starting a new game with ";
+    case FIBS_TypeJoin:                return "Type 'join ";
+    case FIBS_ResumeMatchAck5:         return "You are now playing with ";
+    case FIBS_PlayerInfoStart:         return "Information about ";
+    case FIBS_NewMatchAck2:            return "** Player ";
+    case FIBS_OpponentLeftGame:        return "** Player ";
+    case FIBS_PlayerRefusingGames:     return "** ";
+    case FIBS_DidntInvite:             return "** ";
+    case FIBS_PlayerNotPlaying:        return "** ";
+    case FIBS_WontListen:              return "** ";
+
+    // These messages start with the name
+    case FIBS_PlayerRolls:
+    case FIBS_PlayerMoves:
+    case FIBS_Doubles:
+    case FIBS_AcceptRejectDouble:
+    case FIBS_PlayerAcceptsDouble:
+    case FIBS_PlayerWantsToResign:
+    case FIBS_WatchResign:
+    case FIBS_NewMatchRequest:
+    case FIBS_ResumeMatchRequest:
+    case FIBS_UnlimitedInvite:
+    case FIBS_PlayerStartsWatching:
+    case FIBS_PlayerStopsWatching:
+    case FIBS_PlayerIsWatching:
+    case FIBS_ResignWins:
+    case FIBS_ResignYouWin:
+    case FIBS_AcceptWins:
+    case FIBS_PlayersStartingMatch:
+    case FIBS_PlayersStartingUnlimitedMatch:
+    case FIBS_ResumingUnlimitedMatch:
+    case FIBS_ResumingLimitedMatch:
+    case FIBS_PlayerWinsMatch:
+    case FIBS_MatchResult:
+    case FIBS_PlayerWinsGame:
+    case FIBS_CantMove:
+    case FIBS_Waves:
+    case FIBS_WavesAgain:
+    case FIBS_PlayerIsWaitingForYou:
+    case FIBS_IsAway:
+    case FIBS_ShowMovesStart:
+    case FIBS_ReportLimitedMatch:
+    case FIBS_ReportUnlimitedMatch:
+        return "";
+
+    default:
+        return NULL;
+    }
+}
+
+static int is_name_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '<' || c == '>';
+}
+
+// CLIP messages that have a player name right after the message ID.
+static int clip_has_name(int cookie)
+{
+    switch (cookie) {
+    case CLIP_WELCOME:
+    case CLIP_OWN_INFO:
+    case CLIP_WHO_INFO:
+    case CLIP_LOGIN:
+    case CLIP_LOGOUT:
+    case CLIP_MESSAGE:
+    case CLIP_MESSAGE_DELIVERED:
+    case CLIP_MESSAGE_SAVED:
+    case CLIP_SAYS:
+    case CLIP_SHOUTS:
+    case CLIP_WHISPERS:
+    case CLIP_KIBITZES:
+    case CLIP_YOU_SAY:
+    case CLIP_ALERT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Interns the name at p, unless it is "You".
+static int intern_player(const char * p)
+{
+    size_t length;
+    for (length = 0; is_name_char(p[length]); length++)
+        ;
+    if (length == 0 || (length == 3 && strncmp(p, "You", 3) == 0))
+        return FCM_NO_NAME;
+    return FCM_InternName(p, length);
+}
+
+int FCM_MessagePlayer(int cookie, const char * message)
+{
+    const char * p = message;
+    const char * prefix;
+    size_t length;
+
+    if (clip_has_name(cookie)) {
+        // "<id> name ..."
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p++ != ' ')
+            return FCM_NO_NAME;
+    } else if ((prefix = name_prefix(cookie)) != NULL) {
+        length = strlen(prefix);
+        if (strncmp(p, prefix, length) != 0)
+            return FCM_NO_NAME;
+        p += length;
+    } else {
+        return FCM_NO_NAME;
+    }
+    return intern_player(p);
+}
+
+int FCM_PlayerAt(int cookie, const char * message, int at)
+{
+    if (at < 0 || (!clip_has_name(cookie) && name_prefix(cookie) == NULL))
+        return FCM_MessagePlayer(cookie, message);
+    return intern_player(message + at);
+}
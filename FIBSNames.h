@@ -0,0 +1,46 @@
+/*
+ * ---  FIBSNames.h ----------------------------------------------------------
+ *
+ * Process wide table of player names. Each distinct name gets a small
+ * integer ID, starting at 0, which stays the same for the lifetime of the
+ * process. Clients can then compare players with == and use the ID as an
+ * array index, instead of allocating a string for every name in every message.
+ *
+ * All functions may be called from any thread. Looking up a name that is
+ * already known takes no locks.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef FIBSNAMES_H
+#define FIBSNAMES_H
+
+#include <stddef.h>
+
+#define FCM_NO_NAME (-1)
+
+// Returns the ID of the length bytes at name, adding it if needed.
+// Returns FCM_NO_NAME if out of memory.
+int  FCM_InternName(const char * name, size_t length);
+
+// Like FCM_InternName(), but returns FCM_NO_NAME for names not seen before.
+int  FCM_FindName(const char * name, size_t length);
+
+const char * FCM_NameString(int id);
+int  FCM_NameCount();
+size_t FCM_NameMemory();	// bytes used by the table
+
+// Returns the ID of the player a message is about, e.g. the roller of a
+// FIBS_PlayerRolls or the shouter of a CLIP_SHOUTS message. Returns
+// FCM_NO_NAME if the cookie has no player name, or the player is "You".
+int  FCM_MessagePlayer(int cookie, const char * message);
+
+// Like FCM_MessagePlayer(), but takes the name at offset at, as told by
+// FCM_SessionNameAt() right after the message was classified. Falls back
+// to FCM_MessagePlayer() if at is -1.
+int  FCM_PlayerAt(int cookie, const char * message, int at);
+
+// Frees the table. All IDs are forgotten, no other thread may use the table.
+void FCM_ReleaseNames();
+
+#endif
@@ -0,0 +1,507 @@
+/*
+ * ---  FIBSPlayerTable.c ----------------------------------------------------
+ *
+ * The table is stored by column rather than by row: one array per field,
+ * indexed by row. Range queries like FCM_PlayersByRating() then only walk
+ * the columns they need, and a player costs a few dozen bytes instead of
+ * a heap allocated string for every field.
+ *
+ * Names are interned in the process wide table of FIBSNames.c, and the row of
+ * a player is found from the ID of the name, so a name is only stored once,
+ * whatever number of tables and sessions refer to it. Opponents and watched
+ * players refer to rows. Hostnames live in a string pool, referred to by
+ * offset; a hostname that doesn't fit in place of the old one leaves garbage,
+ * and the pool is compacted once half of it is garbage.
+ *
+ * The online players are also kept sorted by rating, so FCM_PlayersByRating()
+ * is two binary searches. A who update only moves a player when the rating
+ * or the online flag changes. Such players are appended after the sorted ones
+ * until the CLIP_WHO_END that closes the who list, and then sorted into place
+ * all at once: right after login the list holds every player online, and
+ * inserting them one at a time would move the whole array for each of them.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#include "FIBSPlayerTable.h"
+#include "FIBSNames.h"
+#include "clip.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ROW   (-1)
+#define NO_NAME  UINT32_MAX
+
+struct FIBSPlayerTable {
+    int        rows;
+    int        capacity;
+
+    // The columns
+    int32_t  * name;        // IDs from FCM_InternName()
+    int32_t  * opponent;
+    int32_t  * watching;
+    uint8_t  * flags;
+    float    * rating;
+    uint32_t * experience;
+    uint32_t * idle;
+    uint32_t * login;
+    uint32_t * hostname;    // offset into pool, or NO_NAME
+
+    // Name ID -> row, NO_ROW for names not in the table
+    int32_t  * rowOf;
+    int        rowOfSize;
+
+    // The rows of the online players, the first sorted of them by rating and
+    // then row, the rest listed since the last CLIP_WHO_END in any order
+    int32_t  * byRating;
+    int        sorted;
+    int        online;
+
+    char     * pool;
+    size_t     poolUsed;
+    size_t     poolSize;
+    size_t     poolGarbage;
+};
+
+// Moves the hostnames in use to a new pool, dropping the garbage.
+static void compact_pool(FIBSPlayerTable * t)
+{
+    size_t size = 4096;
+    while (size < 2 * (t->poolUsed - t->poolGarbage))
+        size *= 2;
+    char * pool = malloc(size);
+    if (pool == NULL)
+        return;                         // keep the garbage
+    size_t used = 0;
+    for (int row = 0; row < t->rows; row++) {
+        if (t->hostname[row] == NO_NAME)
+            continue;
+        size_t length = strlen(t->pool + t->hostname[row]) + 1;
+        memcpy(pool + used, t->pool + t->hostname[row], length);
+        t->hostname[row] = (uint32_t)used;
+        used += length;
+    }
+    free(t->pool);
+    t->pool = pool;
+    t->poolUsed = used;
+    t->poolSize = size;
+    t->poolGarbage = 0;
+}
+
+// Copies length bytes of s to the pool, returns the offset or NO_NAME if out of memory.
+static uint32_t pool_add(FIBSPlayerTable * t, const char * s, size_t length)
+{
+    if (t->poolUsed + length + 1 > t->poolSize) {
+        size_t size = t->poolSize ? t->poolSize * 2 : 4096;
+        while (size < t->poolUsed + length + 1)
+            size *= 2;
+        char * pool = realloc(t->pool, size);
+        if (pool == NULL)
+            return NO_NAME;
+        t->pool = pool;
+        t->poolSize = size;
+    }
+    uint32_t offset = (uint32_t)t->poolUsed;
+    memcpy(t->pool + offset, s, length);
+    t->pool[offset + length] = '\0';
+    t->poolUsed += length + 1;
+    return offset;
+}
+
+static int find_row(const FIBSPlayerTable * t, const char * name, size_t length)
+{
+    int id = FCM_FindName(name, length);
+    return (id >= 0 && id < t->rowOfSize) ? t->rowOf[id] : NO_ROW;
+}
+
+// Makes room for capacity rows. Columns already grown are just bigger than
+// needed if a later one fails, the table stays as it was.
+static int grow(FIBSPlayerTable * t)
+{
+    int capacity = t->capacity ? t->capacity * 2 : 256;
+
+#define GROW_COLUMN(column) { void * p = realloc(t->column, capacity * sizeof(*t->column)); if (p == NULL) return 0; t->column = p; }
+    GROW_COLUMN(name)
+    GROW_COLUMN(opponent)
+    GROW_COLUMN(watching)
+    GROW_COLUMN(flags)
+    GROW_COLUMN(rating)
+    GROW_COLUMN(experience)
+    GROW_COLUMN(idle)
+    GROW_COLUMN(login)
+    GROW_COLUMN(hostname)
+    GROW_COLUMN(byRating)
+#undef GROW_COLUMN
+    t->capacity = capacity;
+    return 1;
+}
+
+// Makes rowOf big enough for the name ID id.
+static int grow_row_of(FIBSPlayerTable * t, int id)
+{
+    int size = t->rowOfSize ? t->rowOfSize * 2 : 256;
+    while (size <= id)
+        size *= 2;
+    int32_t * rowOf = realloc(t->rowOf, size * sizeof(int32_t));
+    if (rowOf == NULL)
+        return 0;
+    for (int i = t->rowOfSize; i < size; i++)
+        rowOf[i] = NO_ROW;
+    t->rowOf = rowOf;
+    t->rowOfSize = size;
+    return 1;
+}
+
+// Returns the row of name, adding an offline player if we haven't seen the name before.
+static int intern_row(FIBSPlayerTable * t, const char * name, size_t length)
+{
+    int id = FCM_InternName(name, length);
+    if (id == FCM_NO_NAME)
+        return NO_ROW;
+    if (id < t->rowOfSize && t->rowOf[id] != NO_ROW)
+        return t->rowOf[id];
+
+    if (id >= t->rowOfSize && !grow_row_of(t, id))
+        return NO_ROW;
+    if (t->rows == t->capacity && !grow(t))
+        return NO_ROW;
+
+    int row = t->rows++;
+    t->name[row]       = id;
+    t->opponent[row]   = NO_ROW;
+    t->watching[row]   = NO_ROW;
+    t->flags[row]      = 0;
+    t->rating[row]     = 0.0f;
+    t->experience[row] = 0;
+    t->idle[row]       = 0;
+    t->login[row]      = 0;
+    t->hostname[row]   = NO_NAME;
+    t->rowOf[id]       = row;
+    return row;
+}
+
+#define FEW_UPDATES 16       // inserted one at a time at the end of a who list
+
+// Returns the first position in byRating that sorts after (rating, row).
+static int rating_position(const FIBSPlayerTable * t, float rating, int row)
+{
+    int lo = 0, hi = t->sorted;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int other = t->byRating[mid];
+        if (t->rating[other] < rating || (t->rating[other] == rating && other < row))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Inserts row among the sorted players.
+static void rating_insert(FIBSPlayerTable * t, int row)
+{
+    int at = rating_position(t, t->rating[row], row);
+    memmove(t->byRating + at + 1, t->byRating + at, (t->online - at) * sizeof(int32_t));
+    t->byRating[at] = row;
+    t->sorted++;
+    t->online++;
+}
+
+// Adds row after the sorted players, see rating_sort().
+static void rating_append(FIBSPlayerTable * t, int row)
+{
+    t->byRating[t->online++] = row;
+}
+
+static void rating_remove(FIBSPlayerTable * t, int row)
+{
+    int at = rating_position(t, t->rating[row], row);
+    if (at < t->sorted && t->byRating[at] == row) {
+        t->sorted--;
+        t->online--;
+        memmove(t->byRating + at, t->byRating + at + 1, (t->online - at) * sizeof(int32_t));
+        return;
+    }
+    for (at = t->sorted; at < t->online; at++)
+        if (t->byRating[at] == row) {
+            t->byRating[at] = t->byRating[--t->online];
+            return;
+        }
+}
+
+typedef struct RatedRow {
+    float   rating;
+    int32_t row;
+} RatedRow;
+
+static int compare_rated(const void * a, const void * b)
+{
+    const RatedRow * x = a, * y = b;
+    if (x->rating != y->rating)
+        return x->rating < y->rating ? -1 : 1;
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+// Sorts the players appended since the last CLIP_WHO_END into place.
+static void rating_sort(FIBSPlayerTable * t)
+{
+    int count = t->online - t->sorted;
+    RatedRow * added = count > FEW_UPDATES ? malloc(count * sizeof(RatedRow)) : NULL;
+    if (added == NULL) {
+        while (t->online > t->sorted) {
+            int row = t->byRating[--t->online];
+            rating_insert(t, row);
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        added[i].row    = t->byRating[t->sorted + i];
+        added[i].rating = t->rating[added[i].row];
+    }
+    qsort(added, count, sizeof(RatedRow), compare_rated);
+
+    // Merge from the back, so the sorted players only move once.
+    int old = t->sorted - 1, to = t->online - 1;
+    for (int i = count - 1; i >= 0; to--) {
+        int other = old >= 0 ? t->byRating[old] : NO_ROW;
+        if (other != NO_ROW && (t->rating[other] > added[i].rating
+                                || (t->rating[other] == added[i].rating && other > added[i].row)))
+            t->byRating[to] = t->byRating[old--];
+        else
+            t->byRating[to] = added[i--].row;
+    }
+    t->sorted = t->online;
+    free(added);
+}
+
+// Replaces the hostname of row, in place if the new one isn't longer.
+static void set_hostname(FIBSPlayerTable * t, int row, const char * host, size_t length)
+{
+    uint32_t old = t->hostname[row];
+    if (old != NO_NAME) {
+        size_t oldLength = strlen(t->pool + old);
+        if (length <= oldLength) {
+            memcpy(t->pool + old, host, length);
+            t->pool[old + length] = '\0';
+            t->poolGarbage += oldLength - length;
+            return;
+        }
+        t->poolGarbage += oldLength + 1;
+        t->hostname[row] = NO_NAME;
+        if (t->poolGarbage > t->poolUsed / 2)
+            compact_pool(t);
+    }
+    t->hostname[row] = pool_add(t, host, length);
+}
+
+// Returns the start of the next space separated field and its length, or NULL at the end of the message.
+static const char * next_field(const char ** message, size_t * length)
+{
+    const char * p = *message;
+    while (*p == ' ')
+        p++;
+    if (*p == '\0')
+        return NULL;
+    const char * start = p;
+    while (*p && *p != ' ')
+        p++;
+    *length = p - start;
+    *message = p;
+    return start;
+}
+
+// "-" means no player
+static int player_field(FIBSPlayerTable * t, const char * field, size_t length)
+{
+    if (length == 1 && field[0] == '-')
+        return NO_ROW;
+    return intern_row(t, field, length);
+}
+
+// 5 name opponent watching ready away rating experience idle login hostname client email
+static int update_who(FIBSPlayerTable * t, const char * message)
+{
+    const char * field[11];
+    size_t length[11];
+    for (int i = 0; i < 11; i++)
+        if ((field[i] = next_field(&message, &length[i])) == NULL)
+            return NO_ROW;
+
+    // Interning may grow the columns, so look up all the players before writing any of them.
+    int row      = intern_row(t, field[1], length[1]);
+    int opponent = player_field(t, field[2], length[2]);
+    int watching = player_field(t, field[3], length[3]);
+    if (row == NO_ROW)
+        return NO_ROW;
+
+    float rating = strtof(field[6], NULL);
+    if (isnan(rating))
+        rating = 0.0f;
+    int online = t->flags[row] & FCM_PLAYER_ONLINE;
+    if (online && rating != t->rating[row])
+        rating_remove(t, row);
+    if (!online || rating != t->rating[row]) {
+        t->rating[row] = rating;
+        rating_append(t, row);
+    }
+
+    t->opponent[row]   = opponent;
+    t->watching[row]   = watching;
+    t->flags[row]      = FCM_PLAYER_ONLINE
+                       | (field[4][0] == '1' ? FCM_PLAYER_READY : 0)
+                       | (field[5][0] == '1' ? FCM_PLAYER_AWAY : 0);
+    t->experience[row] = strtoul(field[7], NULL, 10);
+    t->idle[row]       = strtoul(field[8], NULL, 10);
+    t->login[row]      = strtoul(field[9], NULL, 10);
+
+    // Hostnames rarely change, only touch the pool when they do.
+    uint32_t host = t->hostname[row];
+    if (host == NO_NAME || strncmp(t->pool + host, field[10], length[10]) || t->pool[host + length[10]])
+        set_hostname(t, row, field[10], length[10]);
+    return row;
+}
+
+// 7 name name logs in.  /  8 name name drops connection.
+static int update_login(FIBSPlayerTable * t, const char * message, int online)
+{
+    const char * field;
+    size_t length;
+    if (next_field(&message, &length) == NULL || (field = next_field(&message, &length)) == NULL)
+        return NO_ROW;
+
+    int row = intern_row(t, field, length);
+    if (row == NO_ROW)
+        return NO_ROW;
+    if (online) {
+        if (!(t->flags[row] & FCM_PLAYER_ONLINE))
+            rating_insert(t, row);
+        t->flags[row] |= FCM_PLAYER_ONLINE;
+    } else {
+        if (t->flags[row] & FCM_PLAYER_ONLINE)
+            rating_remove(t, row);
+        t->flags[row]    = 0;
+        t->opponent[row] = NO_ROW;
+        t->watching[row] = NO_ROW;
+    }
+    return row;
+}
+
+FIBSPlayerTable * FCM_NewPlayerTable()
+{
+    return calloc(1, sizeof(FIBSPlayerTable));
+}
+
+void FCM_FreePlayerTable(FIBSPlayerTable * t)
+{
+    if (t == NULL)
+        return;
+    free(t->name);
+    free(t->opponent);
+    free(t->watching);
+    free(t->flags);
+    free(t->rating);
+    free(t->experience);
+    free(t->idle);
+    free(t->login);
+    free(t->hostname);
+    free(t->rowOf);
+    free(t->byRating);
+    free(t->pool);
+    free(t);
+}
+
+int FCM_PlayerTableUpdate(FIBSPlayerTable * t, int cookie, const char * message)
+{
+    switch (cookie) {
+    case CLIP_WHO_INFO:
+        return update_who(t, message);
+    case CLIP_LOGIN:
+        return update_login(t, message, 1);
+    case CLIP_LOGOUT:
+        return update_login(t, message, 0);
+    case CLIP_WHO_END:
+        rating_sort(t);
+        return NO_ROW;
+    default:
+        return NO_ROW;
+    }
+}
+
+int FCM_PlayerTableRows(const FIBSPlayerTable * t)
+{
+    return t->rows;
+}
+
+int FCM_PlayerTableFind(const FIBSPlayerTable * t, const char * name)
+{
+    return find_row(t, name, strlen(name));
+}
+
+int FCM_PlayersByRating(const FIBSPlayerTable * t, double minRating, double maxRating, int rows[], int maxRows)
+{
+    int first = rating_position(t, (float)minRating, NO_ROW);
+    int end   = rating_position(t, (float)maxRating, INT32_MAX);
+    if (end <= first)
+        return 0;
+    for (int i = 0; i < end - first && i < maxRows; i++)
+        rows[i] = t->byRating[first + i];
+    return end - first;
+}
+
+size_t FCM_PlayerTableMemory(const FIBSPlayerTable * t)
+{
+    size_t perRow = sizeof(*t->name) + sizeof(*t->opponent) + sizeof(*t->watching)
+                  + sizeof(*t->flags) + sizeof(*t->rating) + sizeof(*t->experience)
+                  + sizeof(*t->idle) + sizeof(*t->login) + sizeof(*t->hostname)
+                  + sizeof(*t->byRating);
+    return sizeof(FIBSPlayerTable) + t->capacity * perRow + t->rowOfSize * sizeof(int32_t) + t->poolSize;
+}
+
+const char * FCM_PlayerName(const FIBSPlayerTable * t, int row)
+{
+    return FCM_NameString(t->name[row]);
+}
+
+int FCM_PlayerOpponent(const FIBSPlayerTable * t, int row)
+{
+    return t->opponent[row];
+}
+
+int FCM_PlayerWatching(const FIBSPlayerTable * t, int row)
+{
+    return t->watching[row];
+}
+
+unsigned FCM_PlayerFlags(const FIBSPlayerTable * t, int row)
+{
+    return t->flags[row];
+}
+
+double FCM_PlayerRating(const FIBSPlayerTable * t, int row)
+{
+    return t->rating[row];
+}
+
+int FCM_PlayerExperience(const FIBSPlayerTable * t, int row)
+{
+    return (int)t->experience[row];
+}
+
+int FCM_PlayerIdle(const FIBSPlayerTable * t, int row)
+{
+    return (int)t->idle[row];
+}
+
+long FCM_PlayerLogin(const FIBSPlayerTable * t, int row)
+{
+    return (long)t->login[row];
+}
+
+const char * FCM_PlayerHostname(const FIBSPlayerTable * t, int row)
+{
+    return t->hostname[row] == NO_NAME ? "" : t->pool + t->hostname[row];
+}
@@ -0,0 +1,56 @@
+/*
+ * ---  FIBSPlayerTable.h ----------------------------------------------------
+ *
+ * Optional table of the players logged in to FIBS, kept up to date from the
+ * CLIP_WHO_INFO, CLIP_WHO_END, CLIP_LOGIN and CLIP_LOGOUT messages.
+ *
+ * Pass every message together with its cookie to FCM_PlayerTableUpdate();
+ * messages that do not concern the table are ignored. Players are identified
+ * by row numbers, which never change once a player has been seen.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef FIBSPLAYERTABLE_H
+#define FIBSPLAYERTABLE_H
+
+#include <stddef.h>
+
+typedef struct FIBSPlayerTable FIBSPlayerTable;
+
+// Bits returned by FCM_PlayerFlags()
+enum {
+	FCM_PLAYER_ONLINE = 1,
+	FCM_PLAYER_READY  = 2,
+	FCM_PLAYER_AWAY   = 4
+};
+
+FIBSPlayerTable * FCM_NewPlayerTable();
+void FCM_FreePlayerTable(FIBSPlayerTable * table);
+
+// Returns the row changed by the message, or -1 if the message was ignored.
+int  FCM_PlayerTableUpdate(FIBSPlayerTable * table, int cookie, const char * message);
+
+int  FCM_PlayerTableRows(const FIBSPlayerTable * table);
+int  FCM_PlayerTableFind(const FIBSPlayerTable * table, const char * name);	// row, or -1
+
+// Fills rows[] with the online players rated in [minRating, maxRating],
+// lowest rating first. Returns the number of matching players, which may be more than maxRows.
+// Players listed in a who list only show up once its CLIP_WHO_END has been passed in.
+int  FCM_PlayersByRating(const FIBSPlayerTable * table, double minRating, double maxRating, int rows[], int maxRows);
+
+// Bytes of memory used by the table.
+size_t FCM_PlayerTableMemory(const FIBSPlayerTable * table);
+
+// Per player fields. Opponent and watching are rows, or -1 for none.
+const char * FCM_PlayerName(const FIBSPlayerTable * table, int row);
+int          FCM_PlayerOpponent(const FIBSPlayerTable * table, int row);
+int          FCM_PlayerWatching(const FIBSPlayerTable * table, int row);
+unsigned     FCM_PlayerFlags(const FIBSPlayerTable * table, int row);
+double       FCM_PlayerRating(const FIBSPlayerTable * table, int row);
+int          FCM_PlayerExperience(const FIBSPlayerTable * table, int row);
+int          FCM_PlayerIdle(const FIBSPlayerTable * table, int row);
+long         FCM_PlayerLogin(const FIBSPlayerTable * table, int row);
+const char * FCM_PlayerHostname(const FIBSPlayerTable * table, int row);
+
+#endif
@@ -5,6 +5,9 @@
  * Further modified by Øystein Schønning-Johansen
  * ------------------------------------------ */
 
+#ifndef CLIP_H
+#define CLIP_H
+
 #define CLIP_VERSION 1009  /* Latest standard of February 2016 */
 enum {
 	CLIP_WELCOME = 1,
@@ -29,3 +32,5 @@ enum {
 	CLIP_ALERT
 };
 #define CLIP_LAST_CLIP_ID CLIP_ALERT /* Remember to updater at new revisions of CLIP */
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * ---  bench_memory.c -------------------------------------------------------
+ *
+ * Loads the built-in rules as regexes and as compact rules, and reports the
+ * memory of each with FCM_RulesMemory(), before and after classifying a
+ * session with every engine, and the time per line. The regex figures are
+ * estimates, see FCMMemory. All runs must give the same cookies.
+ *
+ * % cc -std=c99 -O2 -o bench_memory tools/bench_memory.c FIBSCookieMonster.c \
+ *      FIBSCookieNames.c FIBSCompactRegex.c -lpthread
+ * % ./bench_memory [captured session]
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../FIBSCookieMonster.h"
+#include "traffic.h"
+
+#include <time.h>
+
+#define LINES 20000
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void print_memory(const char * when)
+{
+    FCMMemory m;
+    if (!FCM_RulesMemory(&m))
+        return;
+    printf("  %-22s %7zu rules + %7zu regex + %6zu code = %7.1f KB, %d compact\n", when,
+           m.rules, m.regex, m.code, (m.rules + m.regex + m.code) / 1024.0, m.compactRules);
+}
+
+int main(int argc, const char * argv[])
+{
+    static const char * const engines[] = { "candidates", "prefilter", "regexec" };
+    Traffic t = traffic_load(argc > 1 ? argv[1] : NULL, LINES, 500, 1);
+    FCMSession * s = FCM_NewSession();
+    if (s == NULL || t.count == 0)
+        return 2;
+
+    unsigned long sums[2][3];
+    for (int compact = 0; compact < 2; compact++) {
+        FCM_SetCompactRules(compact);
+        if (!FCM_LoadRules(NULL))
+            return 2;
+        printf("%s rules, %d lines\n", compact ? "compact" : "regex", t.count);
+        print_memory("loaded");
+        for (int e = 0; e < 3; e++) {
+            FCM_SelectEngine(engines[e]);
+            FCM_ResetSession(s);
+            sums[compact][e] = 0;
+            double start = seconds();
+            for (int i = 0; i < t.count; i++)
+                sums[compact][e] = sums[compact][e] * 31 + (unsigned)FCM_SessionCookie(s, t.lines[i]);
+            double time = seconds() - start;
+
+            char when[32];
+            snprintf(when, sizeof(when), "after %s", engines[e]);
+            print_memory(when);
+            printf("  %-22s %7.1f ns/line\n", "", time * 1e9 / t.count);
+        }
+    }
+    printf("  session: %zu bytes\n", FCM_SessionMemory(s));
+
+    int agree = 1;
+    for (int compact = 0; compact < 2; compact++)
+        for (int e = 0; e < 3; e++)
+            agree &= sums[compact][e] == sums[0][0];
+    printf("  cookies %s\n", agree ? "agree" : "DIFFER");
+
+    FCM_FreeSession(s);
+    ReleaseFIBSCookieMonster();
+    free(t.lines);
+    return !agree;
+}
@@ -0,0 +1,94 @@
+/*
+ * ---  bench_names.c --------------------------------------------------------
+ *
+ * Interns a number of made up names and reports the memory used per name
+ * and the time to intern a new name and to find a known one. Then runs a
+ * session through the classifier and finds the player of every line both
+ * with FCM_MessagePlayer() and with FCM_PlayerAt(), which must agree.
+ *
+ * % cc -std=c99 -O2 -o bench_names tools/bench_names.c FIBSNames.c \
+ *      FIBSCookieMonster.c FIBSCookieNames.c FIBSCompactRegex.c -lpthread
+ * % ./bench_names [names] [captured session]
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../FIBSNames.h"
+#include "../FIBSCookieMonster.h"
+#include "traffic.h"
+
+#include <time.h>
+
+#define LOOKUPS 1000000
+#define LINES   20000
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, const char * argv[])
+{
+    int names = argc > 1 ? atoi(argv[1]) : 100000;
+    Traffic t = traffic_load(argc > 2 ? argv[2] : NULL, LINES, 500, 1);
+    char name[16];
+    if (names < 1)
+        return 2;
+
+    double start = seconds();
+    for (int i = 0; i < names; i++)
+        if (FCM_InternName(name, strlen(traffic_name(i, name))) != i)
+            return 2;
+    double intern = seconds() - start;
+    size_t memory = FCM_NameMemory();
+
+    start = seconds();
+    long found = 0;
+    for (int i = 0; i < LOOKUPS; i++)
+        found += FCM_FindName(name, strlen(traffic_name((int)traffic_random(&t, names), name))) >= 0;
+    double find = seconds() - start;
+
+    FCMSession * s = FCM_NewSession();
+    if (s == NULL)
+        return 2;
+    int cookies[LINES];
+    for (int i = 0; i < t.count; i++)
+        cookies[i] = FCM_SessionCookie(s, t.lines[i]);
+
+    start = seconds();
+    long players = 0;
+    for (int i = 0; i < t.count; i++)
+        players += FCM_MessagePlayer(cookies[i], t.lines[i]) >= 0;
+    double parsed = seconds() - start;
+
+    // FCM_SessionNameAt() is only valid right after each line, so classify them again.
+    FCM_ResetSession(s);
+    int differ = 0;
+    double located = 0;
+    for (int i = 0; i < t.count; i++) {
+        FCM_SessionCookie(s, t.lines[i]);
+        start = seconds();
+        int player = FCM_PlayerAt(cookies[i], t.lines[i], FCM_SessionNameAt(s));
+        located += seconds() - start;
+        differ += player != FCM_MessagePlayer(cookies[i], t.lines[i]);
+    }
+
+    printf("%d names\n", names);
+    printf("  memory:          %8.1f bytes/name\n", (double)memory / names);
+    printf("  intern:          %8.1f ns\n", intern * 1e9 / names);
+    printf("  find:            %8.1f ns (%ld found)\n", find * 1e9 / LOOKUPS, found);
+    printf("%d lines, %ld with a player\n", t.count, players);
+    printf("  message player:  %8.1f ns/line\n", parsed * 1e9 / t.count);
+    printf("  player at:       %8.1f ns/line, timer included\n", located * 1e9 / t.count);
+    printf("  players %s\n", differ ? "DIFFER" : "agree");
+
+    FCM_FreeSession(s);
+    ReleaseFIBSCookieMonster();
+    FCM_ReleaseNames();
+    free(t.lines);
+    return differ != 0;
+}
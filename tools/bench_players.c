@@ -0,0 +1,119 @@
+/*
+ * ---  bench_players.c ------------------------------------------------------
+ *
+ * Fills a player table with made up who lines and reports the memory used
+ * per player, the time to find a player and to answer rating range queries,
+ * and what the hostname pool looks like after many hostname changes. The
+ * range queries are checked against a walk of the whole table.
+ *
+ * % cc -std=c99 -O2 -o bench_players tools/bench_players.c FIBSPlayerTable.c \
+ *      FIBSNames.c FIBSCookieNames.c -lpthread -lm
+ * % ./bench_players [players]
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../FIBSPlayerTable.h"
+#include "../FIBSNames.h"
+#include "../clip.h"
+#include "traffic.h"
+
+#include <time.h>
+
+#define LOOKUPS 1000000
+#define QUERIES 10000
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The online players rated in [lo, hi], by walking the table.
+static int count_by_rating(const FIBSPlayerTable * table, double lo, double hi)
+{
+    int found = 0;
+    for (int row = 0; row < FCM_PlayerTableRows(table); row++) {
+        double rating = FCM_PlayerRating(table, row);
+        if (rating >= (float)lo && rating <= (float)hi && (FCM_PlayerFlags(table, row) & FCM_PLAYER_ONLINE))
+            found++;
+    }
+    return found;
+}
+
+int main(int argc, const char * argv[])
+{
+    int players = argc > 1 ? atoi(argv[1]) : 100000;
+    Traffic t = { NULL, 0, 1, 1 };
+    char line[TRAFFIC_LINE], name[16];
+    if (players < 1 || (t.lines = malloc(TRAFFIC_LINE)) == NULL)
+        return 2;
+    FIBSPlayerTable * table = FCM_NewPlayerTable();
+    if (table == NULL)
+        return 2;
+
+    double start = seconds();
+    for (int player = 0; player < players; player++) {
+        t.count = 0;
+        traffic_who(&t, player, players);
+        FCM_PlayerTableUpdate(table, CLIP_WHO_INFO, t.lines[0]);
+    }
+    FCM_PlayerTableUpdate(table, CLIP_WHO_END, "6");
+    double fill = seconds() - start;
+    size_t tableBytes = FCM_PlayerTableMemory(table), nameBytes = FCM_NameMemory();
+
+    start = seconds();
+    long found = 0;
+    for (int i = 0; i < LOOKUPS; i++)
+        found += FCM_PlayerTableFind(table, traffic_name((int)traffic_random(&t, players), name)) >= 0;
+    double find = seconds() - start;
+
+    start = seconds();
+    int * rows = malloc(players * sizeof(int));
+    long matched = 0;
+    int wrong = 0;
+    for (int i = 0; i < QUERIES && rows; i++) {
+        double lo = 1400 + traffic_random(&t, 600), hi = lo + traffic_random(&t, 50);
+        int n = FCM_PlayersByRating(table, lo, hi, rows, players);
+        for (int j = 1; j < n; j++)
+            wrong += FCM_PlayerRating(table, rows[j - 1]) > FCM_PlayerRating(table, rows[j]);
+        matched += n;
+        if (i < 100)
+            wrong += n != count_by_rating(table, lo, hi);
+    }
+    double query = seconds() - start;
+
+    // Every player moves to hostnames of different lengths, and logs out and in.
+    for (int round = 0; round < 4; round++) {
+        for (int player = 0; player < players; player++) {
+            traffic_name(player, name);
+            snprintf(line, sizeof(line), "5 %s - - 1 0 %d.00 10 0 1041253132 %.*shost.example.com - -",
+                     name, 1400 + (int)traffic_random(&t, 600), (int)traffic_random(&t, 20), "abcdefghijklmnopqrst");
+            FCM_PlayerTableUpdate(table, CLIP_WHO_INFO, line);
+            FCM_PlayerTableUpdate(table, CLIP_WHO_END, "6");
+            if (player % 10 == round) {
+                snprintf(line, sizeof(line), "8 %s %s drops connection.", name, name);
+                FCM_PlayerTableUpdate(table, CLIP_LOGOUT, line);
+            }
+        }
+    }
+    wrong += count_by_rating(table, 0, 1e9) != FCM_PlayersByRating(table, 0, 1e9, rows, 0);
+
+    printf("%d players\n", players);
+    printf("  memory:       %8.1f bytes/player in the table, %.1f in the name table\n",
+           (double)tableBytes / players, (double)nameBytes / players);
+    printf("  fill:         %8.1f ns/who line\n", fill * 1e9 / players);
+    printf("  find:         %8.1f ns (%ld found)\n", find * 1e9 / LOOKUPS, found);
+    printf("  by rating:    %8.1f ns/query, %.1f players each\n", query * 1e9 / QUERIES, (double)matched / QUERIES);
+    printf("  after churn:  %8.1f bytes/player in the table\n", (double)FCM_PlayerTableMemory(table) / players);
+    printf("  %s\n", wrong ? "range queries WRONG" : "range queries agree");
+
+    free(rows);
+    free(t.lines);
+    FCM_FreePlayerTable(table);
+    FCM_ReleaseNames();
+    return wrong != 0;
+}
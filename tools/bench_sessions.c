@@ -0,0 +1,96 @@
+/*
+ * ---  bench_sessions.c -----------------------------------------------------
+ *
+ * Compares classifying the lines of many sessions with a call per line, to
+ * FCM_SessionCookie(), to a call per round, to FCM_SessionCookies(), which
+ * takes hold of the rules once for a line of every session. Every session
+ * gets the login, MOTD and who list, then the rest of the traffic from a
+ * different starting point.
+ *
+ * % cc -std=c99 -O2 -o bench_sessions tools/bench_sessions.c FIBSCookieMonster.c \
+ *      FIBSCookieNames.c FIBSCompactRegex.c -lpthread
+ * % ./bench_sessions [sessions] [engine] [captured session]
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../FIBSCookieMonster.h"
+#include "traffic.h"
+
+#include <time.h>
+
+#define LINES 4000
+#define ROUNDS 3
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, const char * argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 256;
+    if (argc > 2 && !FCM_SelectEngine(argv[2])) {
+        fprintf(stderr, "No engine called %s\n", argv[2]);
+        return 2;
+    }
+    Traffic t = traffic_load(argc > 3 ? argv[3] : NULL, LINES, 500, 1);
+    if (count < 1 || t.count == 0)
+        return 2;
+
+    // The lines up to the end of the who list reach every session in order.
+    int header = 0;
+    while (header < t.count && strcmp(t.lines[header], "6") != 0)
+        header++;
+    header = header < t.count ? header + 1 : 0;
+
+    FCMSession ** sessions = malloc(count * sizeof(FCMSession *));
+    const char ** messages = malloc(count * sizeof(const char *));
+    int * cookies = malloc(count * sizeof(int));
+    if (sessions == NULL || messages == NULL || cookies == NULL)
+        return 2;
+    for (int i = 0; i < count; i++)
+        if ((sessions[i] = FCM_NewSession()) == NULL)
+            return 2;
+    FIBSCookie("");                     // prepare the rules before timing
+
+    unsigned long sum[2] = { 0, 0 };
+    double time[2] = { 0, 0 };
+    long lines = 0;
+    for (int mode = 0; mode < 2; mode++) {
+        double start = seconds();
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int i = 0; i < count; i++)
+                FCM_ResetSession(sessions[i]);
+            for (int line = 0; line < t.count; line++) {
+                for (int i = 0; i < count; i++) {
+                    int n = line < header ? line : header + (line - header + i * 37) % (t.count - header);
+                    messages[i] = t.lines[n];
+                }
+                if (mode == 0)
+                    for (int i = 0; i < count; i++)
+                        cookies[i] = FCM_SessionCookie(sessions[i], messages[i]);
+                else
+                    FCM_SessionCookies(sessions, messages, cookies, count);
+                for (int i = 0; i < count; i++)
+                    sum[mode] = sum[mode] * 31 + (unsigned)cookies[i];
+            }
+        }
+        time[mode] = seconds() - start;
+        lines = (long)ROUNDS * t.count * count;
+    }
+
+    printf("%d sessions, %d lines each, engine %s\n", count, t.count, FCM_EngineName());
+    printf("  call per line:  %8.1f ns/line\n", time[0] * 1e9 / lines);
+    printf("  call per round: %8.1f ns/line\n", time[1] * 1e9 / lines);
+    printf("  cookies %s\n", sum[0] == sum[1] ? "agree" : "DIFFER");
+
+    for (int i = 0; i < count; i++)
+        FCM_FreeSession(sessions[i]);
+    ReleaseFIBSCookieMonster();
+    return sum[0] != sum[1];
+}
@@ -0,0 +1,65 @@
+/*
+ * ---  bench_substates.c -----------------------------------------------------
+ *
+ * Times one session through a game heavy stretch of traffic with each
+ * engine. Only the candidates engine uses the run sub-states, trying the
+ * rules likely while playing, watching or with a double pending first; the
+ * prefilter engine tries the same rules in batch order with the same literal
+ * text checks, so the difference between the two is what the sub-states buy.
+ * All engines must give the same cookies.
+ *
+ * % cc -std=c99 -O2 -o bench_substates tools/bench_substates.c FIBSCookieMonster.c \
+ *      FIBSCookieNames.c FIBSCompactRegex.c -lpthread
+ * % ./bench_substates [captured session]
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../FIBSCookieMonster.h"
+#include "traffic.h"
+
+#include <time.h>
+
+#define LINES  20000
+#define ROUNDS 10
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, const char * argv[])
+{
+    static const char * const engines[] = { "regexec", "prefilter", "candidates" };
+    Traffic t = traffic_load(argc > 1 ? argv[1] : NULL, LINES, 500, 1);
+    FCMSession * s = FCM_NewSession();
+    if (s == NULL || t.count == 0)
+        return 2;
+    FIBSCookie("");                     // prepare the rules before timing
+
+    unsigned long sums[3];
+    printf("%d lines\n", t.count);
+    for (int e = 0; e < 3; e++) {
+        if (!FCM_SelectEngine(engines[e]))
+            return 2;
+        sums[e] = 0;
+        double start = seconds();
+        for (int round = 0; round < ROUNDS; round++) {
+            FCM_ResetSession(s);
+            for (int i = 0; i < t.count; i++)
+                sums[e] = sums[e] * 31 + (unsigned)FCM_SessionCookie(s, t.lines[i]);
+        }
+        printf("  %-12s %8.1f ns/line\n", engines[e], (seconds() - start) * 1e9 / ((double)ROUNDS * t.count));
+    }
+    int agree = sums[0] == sums[1] && sums[0] == sums[2];
+    printf("  cookies %s\n", agree ? "agree" : "DIFFER");
+
+    FCM_FreeSession(s);
+    ReleaseFIBSCookieMonster();
+    free(t.lines);
+    return !agree;
+}
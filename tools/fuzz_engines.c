@@ -0,0 +1,32 @@
+/*
+ * ---  fuzz_engines.c -------------------------------------------------------
+ *
+ * Checks every engine against the reference engine, with lines made from the
+ * built-in rules, or those in a rules file. Exits with 1 if an engine
+ * disagrees.
+ *
+ * % cc -std=c99 -O2 -o fuzz_engines tools/fuzz_engines.c FIBSCookieMonster.c \
+ *      FIBSCookieNames.c FIBSCompactRegex.c -lpthread
+ * % ./fuzz_engines [lines per rule] [seed] [rules file]
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#include "../FIBSCookieMonster.h"
+
+#include <stdlib.h>
+
+int main(int argc, const char * argv[])
+{
+    int lines = argc > 1 ? atoi(argv[1]) : 100;
+    unsigned seed = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 1;
+    int failed = 0;
+
+    if (argc > 3 && !FCM_LoadRules(argv[3]))
+        return 2;
+    for (int i = 1; FCM_EngineNameAt(i); i++)
+        failed |= FCM_FuzzEngine(FCM_EngineNameAt(i), lines, seed, stdout) != 0;
+
+    ReleaseFIBSCookieMonster();
+    return failed;
+}
@@ -0,0 +1,223 @@
+/*
+ * ---  traffic.h ------------------------------------------------------------
+ *
+ * Made up FIBS traffic for the benchmarks in this directory: a CLIP login,
+ * the MOTD, the who list, and then what a player sees while playing and
+ * watching matches, with chat, logins and who updates of the other players
+ * in between. The lines follow the messages of a real session closely enough
+ * to get the same cookies, but a captured session (see the test program at
+ * the end of FIBSCookieMonster.c) gives more realistic numbers.
+ *
+ * ---------------------------------------------------------------------------
+ */
+
+#ifndef TRAFFIC_H
+#define TRAFFIC_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRAFFIC_LINE 256
+
+typedef struct Traffic {
+    char     (*lines)[TRAFFIC_LINE];
+    int        count;
+    int        size;
+    unsigned   seed;
+} Traffic;
+
+static inline unsigned traffic_random(Traffic * t, unsigned n)
+{
+    t->seed ^= t->seed << 13;           // xorshift
+    t->seed ^= t->seed >> 17;
+    t->seed ^= t->seed << 5;
+    return n ? t->seed % n : 0;
+}
+
+static inline void traffic_add(Traffic * t, const char * format, ...)
+{
+    if (t->count == t->size)
+        return;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(t->lines[t->count++], TRAFFIC_LINE, format, args);
+    va_end(args);
+}
+
+// Player names are letters only, like FIBS names: pa, pb, ... paa, pab, ...
+static inline const char * traffic_name(int player, char name[16])
+{
+    int n = 0;
+    name[n++] = 'p';
+    do {
+        name[n++] = (char)('a' + player % 26);
+        player /= 26;
+    } while (player > 0 && n < 14);
+    name[n] = '\0';
+    return name;
+}
+
+static inline void traffic_board(Traffic * t, const char * opponent, int turn)
+{
+    static const int start[26] = { 0, -2, 0, 0, 0, 0, 5, 0, 3, 0, 0, 0, -5, 5, 0, 0, 0, -3, 0, -5, 0, 0, 0, 0, 2, 0 };
+    char line[TRAFFIC_LINE];
+    int n = snprintf(line, sizeof(line), "board:You:%s:5:0:0", opponent);
+    for (int i = 0; i < 26; i++)
+        n += snprintf(line + n, sizeof(line) - n, ":%d", start[i]);
+    snprintf(line + n, sizeof(line) - n, ":%d:%d:%d:0:0:1:1:1:0:1:-1:0:25:0:0:0:0:2:0:0:0",
+             turn, 1 + (int)traffic_random(t, 6), 1 + (int)traffic_random(t, 6));
+    traffic_add(t, "%s", line);
+}
+
+static inline void traffic_who(Traffic * t, int player, int players)
+{
+    char name[16], opponent[16];
+    int playing = traffic_random(t, 3) == 0;
+    traffic_add(t, "5 %s %s - %d 0 %d.%02d %u %u 1041253132 host%u.example.com - -",
+                traffic_name(player, name),
+                playing ? traffic_name((int)traffic_random(t, players), opponent) : "-",
+                !playing, 1400 + (int)traffic_random(t, 600), (int)traffic_random(t, 100),
+                traffic_random(t, 5000), traffic_random(t, 600), traffic_random(t, 200));
+}
+
+// Chat, logins, logouts and who updates from the other players.
+static inline void traffic_noise(Traffic * t, int players)
+{
+    char name[16];
+    int player = (int)traffic_random(t, players);
+    traffic_name(player, name);
+    switch (traffic_random(t, 6)) {
+    case 0:  traffic_add(t, "12 %s hi there, anyone for a game?", name); break;
+    case 1:  traffic_add(t, "13 %s good luck everybody", name); break;
+    case 2:  traffic_add(t, "7 %s %s logs in.", name, name); break;
+    case 3:  traffic_add(t, "8 %s %s drops connection.", name, name); break;
+    default: traffic_who(t, player, players); break;
+    }
+}
+
+// One game of a match against opponent, with noise between the moves.
+static inline void traffic_game(Traffic * t, const char * opponent, int players, int watching)
+{
+    const char * who = watching ? "pwatched" : "You";
+    traffic_add(t, "Starting a new game with %s.", opponent);
+    traffic_add(t, "%s rolled 3, %s rolled 1", who, opponent);
+    traffic_board(t, opponent, 1);
+    for (int turn = 0; turn < 12; turn++) {
+        int a = 1 + (int)traffic_random(t, 6), b = 1 + (int)traffic_random(t, 6);
+        if (traffic_random(t, 3) == 0)
+            traffic_noise(t, players);
+        if (watching)
+            traffic_add(t, "%s rolls %d and %d", who, a, b);
+        else {
+            traffic_add(t, "It's your turn to roll or double.");
+            traffic_add(t, "You roll %d and %d.", a, b);
+            traffic_add(t, "Please move %d pieces.", a == b ? 4 : 2);
+        }
+        traffic_board(t, opponent, 1);
+        traffic_add(t, "%s rolls %d and %d", opponent, b, a);
+        traffic_add(t, "%s moves 13-%d 24-%d", opponent, 13 - a, 24 - b);
+        traffic_board(t, opponent, -1);
+        if (turn == 6 && traffic_random(t, 2) == 0) {
+            traffic_add(t, "%s doubles. Type 'accept' or 'reject'.", opponent);
+            traffic_add(t, watching ? "%s accepts the double." : "You accept the double. The cube shows 2.", who);
+        }
+    }
+    traffic_add(t, "%s wins the game and gets 2 points. Sorry.", opponent);
+    traffic_add(t, "score in 5 point match: %s-0 %s-2", watching ? who : "me", opponent);
+}
+
+static inline void traffic_whois(Traffic * t, const char * name)
+{
+    traffic_add(t, "Information about %s:", name);
+    traffic_add(t, "  Last login:  Fri Dec 20 17:58 2002 from host.example.com");
+    traffic_add(t, "  Still logged in. 2:12 minutes idle.");
+    traffic_add(t, "  %s is not ready to play, not watching, not playing.", name);
+    traffic_add(t, "  Rating: 1693.11 Experience: 5781");
+    traffic_add(t, "  No email address.");
+}
+
+static inline void traffic_toggles(Traffic * t)
+{
+    static const char * const toggles[] = {
+        "allowpip", "autoboard", "autodouble", "automove", "bell", "crawford", "double", "greedy",
+        "moreboards", "moves", "notify", "ratings", "ready", "report", "silent", "telnet", "wrap"
+    };
+    traffic_add(t, "The current settings are:");
+    for (size_t i = 0; i < sizeof(toggles) / sizeof(toggles[0]); i++)
+        traffic_add(t, "%-16s%s", toggles[i], traffic_random(t, 2) ? "YES" : "NO");
+}
+
+// Fills t with a session of whoever logs in as "me", with players others online.
+static inline void traffic_session(Traffic * t, int players)
+{
+    char name[16];
+    traffic_add(t, "                          F I B S");
+    traffic_add(t, "login: ");
+    traffic_add(t, "1 me 1041253132 host.example.com");
+    traffic_add(t, "2 me 1 1 0 0 0 0 1 1 2396 0 1 0 1 3457.85 0 0 0 0 0 Europe/Oslo");
+    traffic_add(t, "3");
+    for (int i = 0; i < 8; i++)
+        traffic_add(t, "| Message of the day, line %d", i);
+    traffic_add(t, "4");
+    for (int player = 0; player < players; player++)
+        traffic_who(t, player, players);
+    traffic_add(t, "6");
+
+    while (t->count < t->size) {
+        const char * opponent = traffic_name((int)traffic_random(t, players), name);
+        switch (traffic_random(t, 4)) {
+        case 0:
+            traffic_add(t, "You're now watching %s.", opponent);
+            traffic_game(t, opponent, players, 1);
+            traffic_add(t, "You stop watching %s.", opponent);
+            break;
+        case 1:
+            traffic_whois(t, opponent);
+            traffic_toggles(t);
+            break;
+        default:
+            traffic_add(t, "** You are now playing a 5 point match with %s", opponent);
+            traffic_game(t, opponent, players, 0);
+            traffic_game(t, opponent, players, 0);
+            traffic_add(t, "%s wins the 5 point match 5-3 .", opponent);
+            break;
+        }
+        for (int i = (int)traffic_random(t, 8); i > 0; i--)
+            traffic_noise(t, players);
+    }
+}
+
+// Reads a captured session instead, one message per line, without line terminators.
+static inline void traffic_read(Traffic * t, FILE * file)
+{
+    while (t->count < t->size && fgets(t->lines[t->count], TRAFFIC_LINE, file)) {
+        char * line = t->lines[t->count++];
+        line[strcspn(line, "\r\n")] = '\0';
+    }
+}
+
+// A session of size lines, read from path, or made up if path is NULL. Exits if out of memory.
+static inline Traffic traffic_load(const char * path, int size, int players, unsigned seed)
+{
+    Traffic t = { malloc((size_t)size * TRAFFIC_LINE), 0, size, seed ? seed : 1 };
+    if (t.lines == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    if (path == NULL)
+        traffic_session(&t, players);
+    else {
+        FILE * file = fopen(path, "r");
+        if (file == NULL) {
+            fprintf(stderr, "Cannot open %s\n", path);
+            exit(2);
+        }
+        traffic_read(&t, file);
+        fclose(file);
+    }
+    return t;
+}
+
+#endif